@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2008 nsf
+ */
+
+#include "argb.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ARGB_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Premultiplication of ARGB32 pixels: color channels are multiplied by
+ * alpha, x * a / 255 rounded to nearest. With 'opaque' set the alpha of
+ * the result is 0xff, which is what blending onto opaque black gives.
+ * SIMD versions are picked at runtime.
+ */
+
+static void (*premultiply)(uint32_t *, const uint32_t *, size_t, int) =
+    argb_premultiply_scalar;
+
+/**************************************************************************
+  scalar reference
+**************************************************************************/
+
+static inline uint32_t
+mul_div255(uint32_t c, uint32_t a)
+{
+    uint32_t t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+void
+argb_premultiply_scalar(
+    uint32_t *dst, const uint32_t *src, size_t n, int opaque)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+    {
+        uint32_t p = src[i];
+        uint32_t a = p >> 24;
+        dst[i] = ((opaque ? 0xff : a) << 24) |
+                 (mul_div255((p >> 16) & 0xff, a) << 16) |
+                 (mul_div255((p >> 8) & 0xff, a) << 8) |
+                 mul_div255(p & 0xff, a);
+    }
+}
+
+/**************************************************************************
+  SSE2 and AVX2
+**************************************************************************/
+
+#ifdef ARGB_X86
+__attribute__((target("sse2"))) static inline __m128i
+premultiply_sse2_half(__m128i px)
+{
+    /* px: two pixels, 16 bits per channel */
+    __m128i a = _mm_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(px, a), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2"))) static void
+premultiply_sse2(uint32_t *dst, const uint32_t *src, size_t n, int opaque)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i amask = _mm_set1_epi32(0xff000000);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i px = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = premultiply_sse2_half(_mm_unpacklo_epi8(px, zero));
+        __m128i hi = premultiply_sse2_half(_mm_unpackhi_epi8(px, zero));
+        __m128i res = _mm_packus_epi16(lo, hi);
+        res = _mm_andnot_si128(amask, res);
+        res = _mm_or_si128(res, opaque ? amask : _mm_and_si128(px, amask));
+        _mm_storeu_si128((__m128i *)(dst + i), res);
+    }
+    argb_premultiply_scalar(dst + i, src + i, n - i, opaque);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+premultiply_avx2_half(__m256i px)
+{
+    __m256i a = _mm256_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm256_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i t =
+        _mm256_add_epi16(_mm256_mullo_epi16(px, a), _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2"))) static void
+premultiply_avx2(uint32_t *dst, const uint32_t *src, size_t n, int opaque)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i amask = _mm256_set1_epi32(0xff000000);
+    size_t i = 0;
+
+    /* unpack and pack work per 128 bit lane, so the order is preserved */
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i px = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i lo = premultiply_avx2_half(_mm256_unpacklo_epi8(px, zero));
+        __m256i hi = premultiply_avx2_half(_mm256_unpackhi_epi8(px, zero));
+        __m256i res = _mm256_packus_epi16(lo, hi);
+        res = _mm256_andnot_si256(amask, res);
+        res = _mm256_or_si256(
+            res,
+            opaque ? amask : _mm256_and_si256(px, amask));
+        _mm256_storeu_si256((__m256i *)(dst + i), res);
+    }
+    premultiply_sse2(dst + i, src + i, n - i, opaque);
+}
+#endif
+
+/**************************************************************************
+  interface
+**************************************************************************/
+
+int
+argb_kernels(struct argb_kernel *kernels, int max)
+{
+    int n = 0;
+
+    if (n < max)
+    {
+        kernels[n].name = "scalar";
+        kernels[n++].premultiply = argb_premultiply_scalar;
+    }
+#ifdef ARGB_X86
+    __builtin_cpu_init();
+    if (n < max && __builtin_cpu_supports("sse2"))
+    {
+        kernels[n].name = "sse2";
+        kernels[n++].premultiply = premultiply_sse2;
+    }
+    if (n < max && __builtin_cpu_supports("avx2"))
+    {
+        kernels[n].name = "avx2";
+        kernels[n++].premultiply = premultiply_avx2;
+    }
+#endif
+    return n;
+}
+
+void
+argb_init()
+{
+    struct argb_kernel k[ARGB_MAX_KERNELS];
+
+    /* the last one is the widest */
+    premultiply = k[argb_kernels(k, ARGB_MAX_KERNELS) - 1].premultiply;
+}
+
+void
+argb_premultiply(uint32_t *dst, const uint32_t *src, size_t n, int opaque)
+{
+    premultiply(dst, src, n, opaque);
+}
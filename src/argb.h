@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2008 nsf
+ */
+
+#ifndef BMPANEL_ARGB_H
+#define BMPANEL_ARGB_H
+
+#include "common.h"
+
+#define ARGB_MAX_KERNELS 3
+
+struct argb_kernel
+{
+    const char *name;
+    void (*premultiply)(uint32_t *, const uint32_t *, size_t, int);
+};
+
+/* kernels this CPU can run, scalar first */
+int argb_kernels(struct argb_kernel *kernels, int max);
+
+void argb_init();
+void argb_premultiply(uint32_t *dst, const uint32_t *src, size_t n, int opaque);
+void argb_premultiply_scalar(
+    uint32_t *dst, const uint32_t *src, size_t n, int opaque);
+
+#endif
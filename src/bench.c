@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2008 nsf
+ */
+
+/*
+ * Microbenchmarks of the hot paths, built with "make bench". Every bench
+ * checks the fast version against a plain one before timing them.
+ */
+
+#include "argb.h"
+#include "common.h"
+#include "logger.h"
+#include "taskidx.h"
+#include <string.h>
+#include <time.h>
+
+static double
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static uint32_t seed = 1;
+
+static uint32_t
+next_random()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed;
+}
+
+/**************************************************************************
+  premultiplication kernels
+**************************************************************************/
+
+static void
+bench_kernel(
+    struct argb_kernel *k,
+    const uint32_t *src,
+    const uint32_t *ref,
+    uint32_t *dst,
+    size_t n)
+{
+    double start;
+    int i, runs = 16;
+    size_t j;
+
+    k->premultiply(dst, src, n, 0);
+    if (memcmp(dst, ref, n * sizeof(uint32_t)))
+        LOG_WARNING("argb: %s premultiply differs from scalar", k->name);
+    k->premultiply(dst, src, n, 1);
+    for (j = 0; j < n; ++j)
+    {
+        if (dst[j] != (ref[j] | 0xff000000))
+        {
+            LOG_WARNING("argb: %s opaque premultiply differs", k->name);
+            break;
+        }
+    }
+
+    start = now_ms();
+    for (i = 0; i < runs; ++i)
+        k->premultiply(dst, src, n, 0);
+    LOG_MESSAGE(
+        "argb: %s premultiply %.3f ms per %u pixels",
+        k->name,
+        (now_ms() - start) / runs,
+        (uint)n);
+}
+
+static void
+bench_argb()
+{
+    struct argb_kernel k[ARGB_MAX_KERNELS];
+    /* odd size to go through the scalar tails too */
+    size_t i, n = 512 * 512 + 7;
+    uint32_t *src = XMALLOC(uint32_t, n);
+    uint32_t *ref = XMALLOC(uint32_t, n);
+    uint32_t *dst = XMALLOC(uint32_t, n);
+    int j, num = argb_kernels(k, ARGB_MAX_KERNELS);
+
+    for (i = 0; i < n; ++i)
+        src[i] = next_random();
+    argb_premultiply_scalar(ref, src, n, 0);
+
+    for (j = 0; j < num; ++j)
+        bench_kernel(&k[j], src, ref, dst, n);
+
+    xfree(src);
+    xfree(ref);
+    xfree(dst);
+}
+
+/**************************************************************************
+  task index
+**************************************************************************/
+
+#define BENCH_LOOKUPS 100000
+
+/* window ids spread over a few clients, like the X server hands them out */
+static Window
+bench_window(int i)
+{
+    return 0x200000 * (1 + i % 16) + (i / 16) * 3 + 1;
+}
+
+/* what find_task was before the index */
+static struct task *
+find_task_linear(struct task **tasks, int num, Window win)
+{
+    int i;
+    for (i = 0; i < num; ++i)
+    {
+        if (tasks[i]->win == win)
+            return tasks[i];
+    }
+    return 0;
+}
+
+static struct task **
+alloc_tasks(int num)
+{
+    struct task **tasks = XMALLOC(struct task *, num);
+    int i;
+
+    for (i = 0; i < num; ++i)
+    {
+        tasks[i] = XMALLOCZ(struct task, 1);
+        tasks[i]->win = bench_window(i);
+        taskidx_add(tasks[i]);
+    }
+    return tasks;
+}
+
+static void
+free_tasks(struct task **tasks, int num)
+{
+    int i;
+
+    taskidx_clear();
+    for (i = 0; i < num; ++i)
+        xfree(tasks[i]);
+    xfree(tasks);
+}
+
+/* a quarter of the lookups are for unknown windows */
+static void
+bench_task_index(int num)
+{
+    struct task **tasks = alloc_tasks(num);
+    Window *wins = XMALLOC(Window, BENCH_LOOKUPS);
+    double start, linear, hashed;
+    int i, found = 0, bad = 0;
+
+    for (i = 0; i < BENCH_LOOKUPS; ++i)
+        wins[i] = bench_window((next_random() >> 8) % (num + num / 3 + 1));
+    for (i = 0; i < BENCH_LOOKUPS && !bad; ++i)
+        bad = taskidx_find(wins[i]) != find_task_linear(tasks, num, wins[i]);
+
+    start = now_ms();
+    for (i = 0; i < BENCH_LOOKUPS; ++i)
+        found += find_task_linear(tasks, num, wins[i]) != 0;
+    linear = now_ms() - start;
+
+    /* the counts also keep the loops from being optimized out */
+    start = now_ms();
+    for (i = 0; i < BENCH_LOOKUPS; ++i)
+        found -= taskidx_find(wins[i]) != 0;
+    hashed = now_ms() - start;
+    bad |= found != 0;
+
+    /* removal shifts entries back, the rest must stay reachable */
+    for (i = 0; i < num; i += 2)
+        taskidx_remove(tasks[i]->win);
+    for (i = 0; i < num; ++i)
+    {
+        if (taskidx_find(tasks[i]->win) != (i % 2 ? tasks[i] : 0))
+            bad = 1;
+    }
+
+    if (bad)
+        LOG_WARNING("task index differs from the linear walk, %d tasks", num);
+    LOG_MESSAGE(
+        "task index: %d tasks, %d lookups: linear %.3f ms, hashed %.3f ms",
+        num,
+        BENCH_LOOKUPS,
+        linear,
+        hashed);
+
+    free_tasks(tasks, num);
+    xfree(wins);
+}
+
+/**************************************************************************
+  client list merge
+**************************************************************************/
+
+/*
+ * Client list churn: every round closes some windows and opens as many new
+ * ones. The nested loops update_tasks used to run are compared with the
+ * sorted merge and the task index.
+ */
+#define BENCH_TASKS 500
+#define BENCH_ROUNDS 200
+#define BENCH_CHURN 10
+
+/* new client list: some windows replaced, in mixed order */
+static void
+churn_clients(struct task **tasks, Window *clients, int *next)
+{
+    int i, j;
+    Window w;
+
+    for (i = 0; i < BENCH_TASKS; ++i)
+        clients[i] = tasks[i]->win;
+    for (i = 0; i < BENCH_CHURN; ++i)
+        clients[(next_random() >> 8) % BENCH_TASKS] = bench_window((*next)++);
+    for (i = BENCH_TASKS - 1; i > 0; --i)
+    {
+        j = (next_random() >> 8) % (i + 1);
+        w = clients[i];
+        clients[i] = clients[j];
+        clients[j] = w;
+    }
+}
+
+/* the new windows take the tasks of the gone ones */
+static int
+apply_clients(Window *clients, Window *gonewins, int gone)
+{
+    struct task *t;
+    int i, j;
+
+    for (i = 0, j = 0; i < BENCH_TASKS; ++i)
+    {
+        if (taskidx_find(clients[i]))
+            continue;
+        if (j == gone)
+            return 0;
+        t = taskidx_find(gonewins[j++]);
+        taskidx_remove(t->win);
+        t->win = clients[i];
+        taskidx_add(t);
+    }
+    return j == gone;
+}
+
+static void
+bench_update_tasks()
+{
+    struct task **tasks = alloc_tasks(BENCH_TASKS);
+    Window *clients = XMALLOC(Window, BENCH_TASKS);
+    Window *known = XMALLOC(Window, BENCH_TASKS);
+    Window *sorted = XMALLOC(Window, BENCH_TASKS);
+    double start, nested = 0, merged = 0;
+    int i, j, round, next = BENCH_TASKS, bad = 0;
+    int gone, added, gonenested, addednested;
+
+    for (round = 0; round < BENCH_ROUNDS && !bad; ++round)
+    {
+        churn_clients(tasks, clients, &next);
+
+        start = now_ms();
+        gonenested = addednested = 0;
+        for (i = 0; i < BENCH_TASKS; ++i)
+        {
+            for (j = 0; j < BENCH_TASKS; ++j)
+            {
+                if (tasks[i]->win == clients[j])
+                    break;
+            }
+            gonenested += j == BENCH_TASKS;
+        }
+        for (i = 0; i < BENCH_TASKS; ++i)
+            addednested += !find_task_linear(tasks, BENCH_TASKS, clients[i]);
+        nested += now_ms() - start;
+
+        start = now_ms();
+        for (i = 0; i < BENCH_TASKS; ++i)
+        {
+            known[i] = tasks[i]->win;
+            sorted[i] = clients[i];
+        }
+        gone = find_gone_windows(known, BENCH_TASKS, sorted, BENCH_TASKS);
+        added = 0;
+        for (i = 0; i < BENCH_TASKS; ++i)
+            added += !taskidx_find(clients[i]);
+        merged += now_ms() - start;
+
+        bad = gone != gonenested || added != addednested ||
+              !apply_clients(clients, known, gone);
+    }
+
+    if (bad)
+        LOG_WARNING("client list merge differs from the nested loops");
+    LOG_MESSAGE(
+        "client list: %d tasks, %d rounds of %d windows replaced: "
+        "nested %.3f ms, merged %.3f ms",
+        BENCH_TASKS,
+        BENCH_ROUNDS,
+        BENCH_CHURN,
+        nested,
+        merged);
+
+    free_tasks(tasks, BENCH_TASKS);
+    xfree(clients);
+    xfree(known);
+    xfree(sorted);
+}
+
+int
+main(int argc, char **argv)
+{
+    log_attach_callback(log_console_callback);
+    bench_argb();
+    bench_task_index(10);
+    bench_task_index(100);
+    bench_task_index(1000);
+    bench_update_tasks();
+    xmemleaks();
+    return 0;
+}
@@ -4,6 +4,7 @@
 
 #include <X11/Xutil.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <stdint.h>
@@ -29,6 +30,8 @@
 #endif
 
 #include "bmpanel.h"
+#include "icon.h"
+#include "taskidx.h"
 #include "logger.h"
 #include "render.h"
 #include "theme.h"
@@ -74,7 +77,10 @@ static char *atom_names[] = {
     "_NET_SYSTEM_TRAY_OPCODE",
     "UTF8_STRING",
     "_MOTIF_WM_HINTS",
-    "_XROOTPMAP_ID"};
+    "_XROOTPMAP_ID",
+    "WM_HINTS",
+    "WM_ICON_NAME",
+    "WM_NAME"};
 
 #ifndef PREFIX
 #define PREFIX "/usr"
@@ -89,11 +95,24 @@ static char *atom_names[] = {
 static struct xinfo X;
 static struct panel P;
 
-static int timerfd;
-
 static int commence_taskbar_redraw;
 static int commence_panel_redraw;
 static int commence_switcher_redraw;
+static int commence_relayout;
+
+/* event loop statistics, dumped on exit */
+static struct
+{
+    uint events;
+    uint frames;
+    uint max_batch;
+    uint coalesced;
+    uint types[LASTEvent];
+    uint root;
+    uint panel;
+    uint tasks;
+    uint other;
+} stats;
 
 static const char *theme = "darkmini";
 static const char *version = "bmpanel version " BMPANEL_VERSION;
@@ -101,6 +120,8 @@ static const char *usage =
     "usage: bmpanel [--version] [--help] [--usage] [--list] THEME";
 
 static void cleanup();
+static double time_ms();
+static void set_title_timer(double ms);
 
 /**************************************************************************
   X error handlers
@@ -128,185 +149,570 @@ X_io_error_handler(Display *dpy)
   window properties
 **************************************************************************/
 
-static void *
-get_prop_data(Window win, Atom prop, Atom type, int *items)
+/*
+ * Properties are fetched through XCB. request_prop() only sends the
+ * request, the reply is collected by the first get_prop_data() call on it.
+ * Callers send everything they need first and then collect, so N
+ * properties cost one round trip instead of N.
+ */
+struct prop
 {
-    Atom type_ret;
-    int format_ret;
-    unsigned long items_ret;
-    unsigned long after_ret;
-    uchar *prop_data;
+    xcb_get_property_cookie_t cookie;
+    xcb_get_property_reply_t *reply;
+    int pending;
+};
 
-    prop_data = 0;
+static void
+request_prop_part(
+    struct prop *p,
+    Window win,
+    Atom prop,
+    Atom type,
+    uint32_t offset,
+    uint32_t len)
+{
+    p->cookie = xcb_get_property(X.xcb, 0, win, prop, type, offset, len);
+    p->reply = 0;
+    p->pending = 1;
+}
+
+static void
+request_prop(struct prop *p, Window win, Atom prop, Atom type)
+{
+    request_prop_part(p, win, prop, type, 0, 0x7fffffff);
+}
+
+static void *
+get_prop_data(struct prop *p, int *items)
+{
+    if (p->pending)
+    {
+        xcb_generic_error_t *err = 0;
+        p->reply = xcb_get_property_reply(X.xcb, p->cookie, &err);
+        p->pending = 0;
+        /* BadWindow, window is gone already */
+        free(err);
+    }
 
-    XGetWindowProperty(
-        X.display,
-        win,
-        prop,
-        0,
-        0x7fffffff,
-        False,
-        type,
-        &type_ret,
-        &format_ret,
-        &items_ret,
-        &after_ret,
-        &prop_data);
     if (items)
-        *items = items_ret;
+        *items = 0;
+    if (!p->reply || !p->reply->value_len)
+        return 0;
+    if (items)
+        *items = p->reply->value_len;
+    return xcb_get_property_value(p->reply);
+}
+
+static void *
+get_prop_data32(struct prop *p, int *items)
+{
+    void *data = get_prop_data(p, items);
+    if (data && p->reply->format != 32)
+    {
+        if (items)
+            *items = 0;
+        return 0;
+    }
+    return data;
+}
 
-    return prop_data;
+static uint32_t
+get_prop_first(struct prop *p)
+{
+    uint32_t *data = get_prop_data32(p, 0);
+    return data ? *data : 0;
 }
 
-static int
-get_prop_int(Window win, Atom at)
+static char *
+alloc_prop_string(struct prop *p)
 {
-    int num = 0;
-    long *data;
+    int len;
+    char *ret, *data = get_prop_data(p, &len);
+    if (!data || p->reply->format != 8)
+        return 0;
+
+    /* XCB doesn't terminate strings like Xlib does */
+    ret = xmalloc(len + 1);
+    memcpy(ret, data, len);
+    ret[len] = '\0';
+    return ret;
+}
+
+static void
+free_prop(struct prop *p)
+{
+    if (p->pending)
+        xcb_discard_reply(X.xcb, p->cookie.sequence);
+    free(p->reply);
+    p->reply = 0;
+    p->pending = 0;
+}
+
+/*
+ * Property mirror. Single value properties of the root window and of the
+ * windows we track are kept here once read, their PropertyNotify is the
+ * only thing that throws a value away. That's why only windows which
+ * PropertyChangeMask we have selected are mirrored, other windows are read
+ * directly. mirror_prefetch() sends the request without waiting, so a
+ * mirrored value can be pipelined with other requests as well.
+ */
+struct mirror_entry
+{
+    struct prop p;
+    uint32_t value;
+    int valid;
+};
+
+struct prop_mirror
+{
+    struct mirror_entry e[XATOM_COUNT];
+};
+
+static struct prop_mirror rootmirror;
+
+static struct
+{
+    uint hits;
+    uint misses;
+} mirrorstats;
+
+static struct task *find_task(Window win);
+
+static struct prop_mirror *
+get_mirror(Window win)
+{
+    struct task *t;
+    if (win == X.root)
+        return &rootmirror;
+    t = find_task(win);
+    if (!t)
+        return 0;
+    if (!t->mirror)
+        t->mirror = XMALLOCZ(struct prop_mirror, 1);
+    return t->mirror;
+}
+
+static void
+mirror_prefetch(Window win, int atom, Atom type)
+{
+    struct prop_mirror *m = get_mirror(win);
+    if (!m || m->e[atom].valid || m->e[atom].p.pending)
+        return;
+    request_prop(&m->e[atom].p, win, X.atoms[atom], type);
+}
+
+static uint32_t
+mirror_get(Window win, int atom, Atom type)
+{
+    struct prop_mirror *m = get_mirror(win);
+    struct mirror_entry *e;
+    struct prop p;
+    uint32_t ret;
 
-    data = get_prop_data(win, at, XA_CARDINAL, 0);
-    if (data)
+    if (!m)
     {
-        num = *data;
-        XFree(data);
+        mirrorstats.misses++;
+        request_prop(&p, win, X.atoms[atom], type);
+        ret = get_prop_first(&p);
+        free_prop(&p);
+        return ret;
+    }
+
+    e = &m->e[atom];
+    if (e->valid)
+    {
+        mirrorstats.hits++;
+        return e->value;
     }
-    return num;
+
+    mirrorstats.misses++;
+    if (!e->p.pending)
+        request_prop(&e->p, win, X.atoms[atom], type);
+    e->value = get_prop_first(&e->p);
+    e->valid = 1;
+    free_prop(&e->p);
+    return e->value;
 }
 
-static Window
-get_prop_window(Window win, Atom at)
+static void
+mirror_invalidate(Window win, int atom)
 {
-    Window num = 0;
-    Window *data;
-
-    data = get_prop_data(win, at, XA_WINDOW, 0);
-    if (data)
+    struct prop_mirror *m = (win == X.root) ? &rootmirror : 0;
+    if (!m)
     {
-        num = *data;
-        XFree(data);
+        struct task *t = find_task(win);
+        m = t ? t->mirror : 0;
     }
-    return num;
+    if (!m)
+        return;
+
+    /* a reply in flight may carry the old value */
+    free_prop(&m->e[atom].p);
+    m->e[atom].valid = 0;
+}
+
+static void
+free_mirror(struct prop_mirror *m)
+{
+    int i;
+    for (i = 0; i < XATOM_COUNT; ++i)
+        free_prop(&m->e[i].p);
+}
+
+static int
+get_prop_int(Window win, int atom)
+{
+    return (int)mirror_get(win, atom, XA_CARDINAL);
+}
+
+static Window
+get_prop_window(Window win, int atom)
+{
+    return mirror_get(win, atom, XA_WINDOW);
 }
 
 static Pixmap
-get_prop_pixmap(Window win, Atom at)
+get_prop_pixmap(Window win, int atom)
+{
+    return mirror_get(win, atom, XA_PIXMAP);
+}
+
+/*
+ * _NET_WM_ICON usually carries several sizes of the same icon and we need
+ * only one of them. So the icon is read header first: while walking the
+ * entries only their (width, height) pairs are requested, then the pixels
+ * of the entry closest to the theme icon size. Fetches for a batch of
+ * windows advance in lockstep, which costs a round trip per step instead
+ * of one per window and step.
+ */
+enum
 {
-    Pixmap num = 0;
-    Pixmap *data;
+    ICON_FETCH_NONE,
+    ICON_FETCH_HEADER,
+    ICON_FETCH_DATA,
+    ICON_FETCH_DEFERRED /* not fetched, the task gets a placeholder */
+};
 
-    data = get_prop_data(win, at, XA_PIXMAP, 0);
-    if (data)
-    {
-        num = *data;
-        XFree(data);
-    }
-    return num;
+struct icon_fetch
+{
+    Window win;
+    struct prop p;
+    int state;
+    uint32_t total; /* property length in longs */
+    uint32_t offset; /* offset of the entry header in flight */
+    uint32_t best; /* offset of the best entry so far */
+    uint32_t w, h; /* size of the best entry */
+};
+
+static void
+request_icon_header(struct icon_fetch *f)
+{
+    request_prop_part(
+        &f->p,
+        f->win,
+        X.atoms[XATOM_NET_WM_ICON],
+        XA_CARDINAL,
+        f->offset,
+        2);
+    f->state = ICON_FETCH_HEADER;
+}
+
+static void
+start_icon_fetch(struct icon_fetch *f, Window win)
+{
+    memset(f, 0, sizeof(struct icon_fetch));
+    f->win = win;
+    request_icon_header(f);
+}
+
+static void
+cancel_icon_fetch(struct icon_fetch *f)
+{
+    free_prop(&f->p);
+    f->state = ICON_FETCH_NONE;
+}
+
+static void
+defer_icon_fetch(struct icon_fetch *f)
+{
+    cancel_icon_fetch(f);
+    f->state = ICON_FETCH_DEFERRED;
 }
 
 static int
-get_window_desktop(Window win)
+is_better_icon_size(uint32_t w, uint32_t h, uint32_t bw, uint32_t bh)
 {
-    return get_prop_int(win, X.atoms[XATOM_NET_WM_DESKTOP]);
+    uint32_t tw = P.theme->taskbar.icon_w;
+    uint32_t th = P.theme->taskbar.icon_h;
+    int big = (w >= tw && h >= th);
+    int bbig = (bw >= tw && bh >= th);
+
+    if (!bw || big != bbig)
+        return !bw || big;
+
+    /* smallest of the ones we scale down, biggest of the ones we scale up */
+    if (big)
+        return (uint64_t)w * h < (uint64_t)bw * bh;
+    return (uint64_t)w * h > (uint64_t)bw * bh;
 }
 
+/*
+ * Collects the header reply in flight and sends the next request. Returns
+ * non-zero if another header was requested.
+ */
 static int
-is_window_hidden(Window win)
+step_icon_fetch(struct icon_fetch *f)
 {
-    Atom *data;
-    int ret = 0;
+    uint32_t *data;
+    uint32_t w, h;
+    uint64_t next;
     int num;
 
-    data =
-        get_prop_data(win, X.atoms[XATOM_NET_WM_WINDOW_TYPE], XA_ATOM, &num);
-    if (data)
+    if (f->state != ICON_FETCH_HEADER)
+        return 0;
+
+    data = get_prop_data32(&f->p, &num);
+    if (data && num == 2)
     {
-        if (*data == X.atoms[XATOM_NET_WM_WINDOW_TYPE_DOCK] ||
-            *data == X.atoms[XATOM_NET_WM_WINDOW_TYPE_DESKTOP])
+        if (!f->offset)
+            f->total = 2 + f->p.reply->bytes_after / 4;
+        w = data[0];
+        h = data[1];
+        next = (uint64_t)f->offset + 2 + (uint64_t)w * h;
+        if (w && h && next <= f->total)
         {
-            XFree(data);
-            return 1;
+            if (is_better_icon_size(w, h, f->w, f->h))
+            {
+                f->best = f->offset;
+                f->w = w;
+                f->h = h;
+            }
+
+            if ((w != P.theme->taskbar.icon_w ||
+                 h != P.theme->taskbar.icon_h) &&
+                next + 2 <= f->total)
+            {
+                free_prop(&f->p);
+                f->offset = next;
+                request_icon_header(f);
+                return 1;
+            }
         }
-        XFree(data);
     }
+    free_prop(&f->p);
 
-    data = get_prop_data(win, X.atoms[XATOM_NET_WM_STATE], XA_ATOM, &num);
-    if (!data)
-        return 0;
-
-    while (num)
+    f->state = ICON_FETCH_NONE;
+    if (f->w)
     {
-        num--;
-        if (data[num] == X.atoms[XATOM_NET_WM_STATE_SKIP_TASKBAR])
-            ret = 1;
+        request_prop_part(
+            &f->p,
+            f->win,
+            X.atoms[XATOM_NET_WM_ICON],
+            XA_CARDINAL,
+            f->best + 2,
+            f->w * f->h);
+        f->state = ICON_FETCH_DATA;
     }
-    XFree(data);
+    return 0;
+}
 
-    return ret;
+/*
+ * Everything add_task needs to know about a window, requested in one go.
+ * Window name sources are listed in order of preference.
+ */
+#define NAME_PROPS 6
+
+struct task_props
+{
+    struct prop type;
+    struct prop state;
+    struct prop wmstate;
+    struct prop desktop;
+    struct prop wmclass;
+    struct icon_fetch icon;
+    struct prop names[NAME_PROPS];
+
+    /* decoded early, owned by the task once it's created */
+    char *class;
+    Imlib_Image diskicon;
+};
+
+static struct
+{
+    int index; /* in X.atoms */
+    Atom atom;
+    Atom type;
+} name_props[NAME_PROPS];
+
+static void
+init_name_props()
+{
+    int atoms[NAME_PROPS] = {
+        XATOM_NET_WM_VISIBLE_ICON_NAME,
+        XATOM_NET_WM_ICON_NAME,
+        XATOM_WM_ICON_NAME,
+        XATOM_NET_WM_VISIBLE_NAME,
+        XATOM_NET_WM_NAME,
+        XATOM_WM_NAME};
+    int i;
+
+    for (i = 0; i < NAME_PROPS; ++i)
+    {
+        name_props[i].index = atoms[i];
+        name_props[i].atom = X.atoms[atoms[i]];
+        name_props[i].type = (atoms[i] == XATOM_WM_ICON_NAME ||
+                              atoms[i] == XATOM_WM_NAME)
+                                 ? XA_STRING
+                                 : X.atoms[XATOM_UTF8_STRING];
+    }
 }
 
 static int
-is_window_iconified(Window win)
+find_name_prop(int atom)
+{
+    int i;
+    for (i = 0; i < NAME_PROPS; ++i)
+    {
+        if (name_props[i].index == atom)
+            return i;
+    }
+    return -1;
+}
+
+/* requests name sources from 'first' to 'last', others are left alone */
+static void
+request_name_props(struct prop *names, Window win, int first, int last)
 {
-    long *data;
-    int ret = 0;
+    /* titles are capped, there's no point in transferring what we clip */
+    int max = P.theme->taskbar.title_max_len;
+    uint32_t len = (max > 0) ? (max + 3) / 4 : 0x7fffffff;
+    int i;
+
+    for (i = first; i <= last; ++i)
+    {
+        request_prop_part(
+            &names[i],
+            win,
+            name_props[i].atom,
+            name_props[i].type,
+            0,
+            len);
+    }
+}
 
-    data = get_prop_data(
+static void
+request_state_props(struct task_props *tp, Window win)
+{
+    request_prop(&tp->type, win, X.atoms[XATOM_NET_WM_WINDOW_TYPE], XA_ATOM);
+    request_prop(&tp->state, win, X.atoms[XATOM_NET_WM_STATE], XA_ATOM);
+    request_prop(
+        &tp->wmstate,
         win,
         X.atoms[XATOM_WM_STATE],
-        X.atoms[XATOM_WM_STATE],
-        0);
-    if (data)
+        X.atoms[XATOM_WM_STATE]);
+}
+
+static void
+request_task_props(struct task_props *tp, Window win)
+{
+    memset(tp, 0, sizeof(struct task_props));
+    request_state_props(tp, win);
+    request_prop(&tp->desktop, win, X.atoms[XATOM_NET_WM_DESKTOP], XA_CARDINAL);
+    request_prop_part(&tp->wmclass, win, XA_WM_CLASS, XA_STRING, 0, 32);
+    request_name_props(tp->names, win, 0, NAME_PROPS - 1);
+    if (THEME_USE_TASKBAR_ICON(P.theme))
+        start_icon_fetch(&tp->icon, win);
+}
+
+static void
+free_task_props(struct task_props *tp)
+{
+    int i;
+    free_prop(&tp->type);
+    free_prop(&tp->state);
+    free_prop(&tp->wmstate);
+    free_prop(&tp->desktop);
+    free_prop(&tp->wmclass);
+    free_prop(&tp->icon.p);
+    if (tp->class)
+        xfree(tp->class);
+    if (tp->diskicon)
+        icon_cache_release(tp->diskicon);
+    for (i = 0; i < NAME_PROPS; ++i)
+        free_prop(&tp->names[i]);
+}
+
+static int
+is_window_hidden(struct task_props *tp)
+{
+    uint32_t *data;
+    int num;
+
+    data = get_prop_data32(&tp->type, &num);
+    if (data && (*data == X.atoms[XATOM_NET_WM_WINDOW_TYPE_DOCK] ||
+                 *data == X.atoms[XATOM_NET_WM_WINDOW_TYPE_DESKTOP]))
+        return 1;
+
+    data = get_prop_data32(&tp->state, &num);
+    while (num)
     {
-        if (data[0] == IconicState)
-        {
-            ret = 1;
-        }
-        XFree(data);
+        num--;
+        if (data[num] == X.atoms[XATOM_NET_WM_STATE_SKIP_TASKBAR])
+            return 1;
     }
+    return 0;
+}
 
+static int
+is_window_iconified(struct task_props *tp)
+{
+    uint32_t *data;
     int num;
-    data = get_prop_data(win, X.atoms[XATOM_NET_WM_STATE], XA_ATOM, &num);
-    if (data)
+
+    data = get_prop_data32(&tp->wmstate, 0);
+    if (data && data[0] == IconicState)
+        return 1;
+
+    data = get_prop_data32(&tp->state, &num);
+    while (num)
     {
-        while (num)
-        {
-            num--;
-            if (data[num] == X.atoms[XATOM_NET_WM_STATE_HIDDEN])
-                ret = 1;
-        }
-        XFree(data);
+        num--;
+        if (data[num] == X.atoms[XATOM_NET_WM_STATE_HIDDEN])
+            return 1;
     }
-
-    return ret;
+    return 0;
 }
 
 static Imlib_Image
-get_window_icon(Window win)
+get_window_icon(Window win, struct icon_fetch *icon)
 {
     if (!THEME_USE_TASKBAR_ICON(P.theme))
         return 0;
 
-    Imlib_Image ret = 0;
+    Imlib_Image ret = 0, cached;
+    int tw = P.theme->taskbar.icon_w;
+    int th = P.theme->taskbar.icon_h;
+    uint64_t key = 0;
 
     int num = 0;
-    long *data =
-        get_prop_data(win, X.atoms[XATOM_NET_WM_ICON], XA_CARDINAL, &num);
-    if (data)
-    {
-        long *datal = data;
-        uint32_t w, h;
-        int i;
-        w = *datal++;
-        h = *datal++;
-        /* hack for 64 bit systems */
-        uint32_t *array = XMALLOC(uint32_t, w * h);
-        for (i = 0; i < w * h; ++i)
-            array[i] = datal[i];
-        ret = imlib_create_image_using_copied_data(w, h, array);
-        xfree(array);
+    uint32_t *data = 0;
+    if (icon->state == ICON_FETCH_DATA)
+        data = get_prop_data32(&icon->p, &num);
+    if (data && num == icon->w * icon->h)
+    {
+        /* identical icon bytes share one scaled image */
+        key = icon_hash(data, icon->w, icon->h, tw, th);
+        cached = icon_cache_find(key);
+        if (cached)
+            return cached;
+
+        /*
+         * format 32 data is already 32 bit wide, the image uses the reply
+         * as is, it's scaled and freed below while the reply is alive
+         */
+        ret = imlib_create_image_using_data(icon->w, icon->h, data);
         imlib_context_set_image(ret);
         imlib_image_set_has_alpha(1);
-        XFree(data);
     }
 
     if (!ret)
@@ -341,6 +747,23 @@ get_window_icon(Window win)
             }
             XFree(hints);
         }
+
+        if (ret)
+        {
+            imlib_context_set_image(ret);
+            key = icon_hash(
+                imlib_image_get_data_for_reading_only(),
+                imlib_image_get_width(),
+                imlib_image_get_height(),
+                tw,
+                th);
+            cached = icon_cache_find(key);
+            if (cached)
+            {
+                imlib_free_image();
+                return cached;
+            }
+        }
     }
 
     /* if we can't get icon, set default and return */
@@ -355,89 +778,144 @@ get_window_icon(Window win)
     imlib_context_set_image(ret);
     w = imlib_image_get_width();
     h = imlib_image_get_height();
-    Imlib_Image sizedicon = imlib_create_cropped_scaled_image(
-        0,
-        0,
-        w,
-        h,
-        P.theme->taskbar.icon_w,
-        P.theme->taskbar.icon_h);
+    Imlib_Image sizedicon =
+        imlib_create_cropped_scaled_image(0, 0, w, h, tw, th);
     imlib_free_image();
     imlib_context_set_image(sizedicon);
     imlib_image_set_has_alpha(1);
 
-    return sizedicon;
+    return icon_cache_add(key, sizedicon);
 }
 
 static char *
-alloc_window_name(Window win)
+alloc_window_class(struct prop *wmclass)
 {
-    char *ret, *name = 0;
-    name = get_prop_data(
-        win,
-        X.atoms[XATOM_NET_WM_VISIBLE_ICON_NAME],
-        X.atoms[XATOM_UTF8_STRING],
-        0);
-    if (name)
-        goto name_here;
-    name = get_prop_data(
-        win,
-        X.atoms[XATOM_NET_WM_ICON_NAME],
-        X.atoms[XATOM_UTF8_STRING],
-        0);
-    if (name)
-        goto name_here;
-    name = get_prop_data(win, XA_WM_ICON_NAME, XA_STRING, 0);
-    if (name)
-        goto name_here;
-    name = get_prop_data(
-        win,
-        X.atoms[XATOM_NET_WM_VISIBLE_NAME],
-        X.atoms[XATOM_UTF8_STRING],
-        0);
-    if (name)
-        goto name_here;
-    name = get_prop_data(
-        win,
-        X.atoms[XATOM_NET_WM_NAME],
-        X.atoms[XATOM_UTF8_STRING],
-        0);
-    if (name)
-        goto name_here;
-    name = get_prop_data(win, XA_WM_NAME, XA_STRING, 0);
-    if (name)
-        goto name_here;
-
-    return xstrdup("<unknown>");
-name_here:
-    ret = xstrdup(name);
-    XFree(name);
-    return ret;
-}
+    /* WM_CLASS is "instance\0class\0", we want the class */
+    int len;
+    char *ret, *data = alloc_prop_string(wmclass);
+    if (!data)
+        return 0;
 
-/**************************************************************************
-  creating panel window
-**************************************************************************/
+    len = strlen(data);
+    if (len + 1 < wmclass->reply->value_len && data[len + 1])
+    {
+        ret = xstrdup(data + len + 1);
+        xfree(data);
+        return ret;
+    }
+    return data;
+}
 
-#ifdef WITH_COMPOSITE
-static Visual *
-find_argb_visual()
+/* length of str without an incomplete character at the end */
+static int
+cut_partial_utf8(const char *str, int len)
 {
-    XVisualInfo *xvi;
-    XVisualInfo template;
-    int nvi, i;
-    XRenderPictFormat *format;
-    Visual *visual;
+    int i = len, need;
+    uchar c;
+
+    /* find the lead byte of the last sequence */
+    while (i > 0 && len - i < 3 && ((uchar)str[i - 1] & 0xC0) == 0x80)
+        i--;
+    if (!i)
+        return len;
+
+    c = str[i - 1];
+    if (c < 0x80)
+        return len;
+    need = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : 2;
+    if (len - (i - 1) < need)
+        return i - 1;
+    return len;
+}
 
-    template.screen = X.screen;
-    template.depth = 32;
-    template.class = TrueColor;
-    xvi = XGetVisualInfo(
-        X.display,
-        VisualScreenMask | VisualDepthMask | VisualClassMask,
-        &template,
-        &nvi);
-    if (xvi == 0)
+/*
+ * Task title lives in a buffer owned by the task, the bytes are copied
+ * there straight from the reply. The buffer is reused while the title
+ * fits, and with capped titles it always does. Returns non-zero if the
+ * title bytes changed.
+ */
+static int
+set_task_name(struct task *t, const char *name, int len)
+{
+    if (t->name && t->namelen == len && !memcmp(t->name, name, len))
+        return 0;
+
+    if (len + 1 > t->namealloc)
+    {
+        if (t->name)
+            xfree(t->name);
+        t->namealloc = len + 1;
+        t->name = xmalloc(t->namealloc);
+    }
+    memcpy(t->name, name, len);
+    t->name[len] = '\0';
+    t->namelen = len;
+    t->extents.font = 0;
+    return 1;
+}
+
+/*
+ * Takes the first name source from 'first' to 'last' that is set. Returns
+ * -1 if none of them is, otherwise what set_task_name() returns.
+ */
+static int
+read_task_name(struct task *t, struct prop *names, int first, int last)
+{
+    char *data;
+    int i, len;
+
+    for (i = first; i <= last; ++i)
+    {
+        data = get_prop_data(&names[i], &len);
+        if (!data || names[i].reply->format != 8)
+            continue;
+
+        /* stop at the first NUL like Xlib users do */
+        len = strnlen(data, len);
+
+        /* capped title may end in the middle of a character */
+        if (names[i].reply->bytes_after &&
+            names[i].reply->type == X.atoms[XATOM_UTF8_STRING])
+            len = cut_partial_utf8(data, len);
+        t->namesrc = i;
+        return set_task_name(t, data, len);
+    }
+    return -1;
+}
+
+static void
+read_task_name_all(struct task *t, struct prop *names)
+{
+    if (read_task_name(t, names, 0, NAME_PROPS - 1) == -1)
+    {
+        t->namesrc = NAME_PROPS;
+        set_task_name(t, "<unknown>", 9);
+    }
+}
+
+/**************************************************************************
+  creating panel window
+**************************************************************************/
+
+#ifdef WITH_COMPOSITE
+static Visual *
+find_argb_visual()
+{
+    XVisualInfo *xvi;
+    XVisualInfo template;
+    int nvi, i;
+    XRenderPictFormat *format;
+    Visual *visual;
+
+    template.screen = X.screen;
+    template.depth = 32;
+    template.class = TrueColor;
+    xvi = XGetVisualInfo(
+        X.display,
+        VisualScreenMask | VisualDepthMask | VisualClassMask,
+        &template,
+        &nvi);
+    if (xvi == 0)
         return 0;
 
     visual = 0;
@@ -542,7 +1020,7 @@ create_panel_window(uint placement, int alignment, int h, int w, int hover)
     XSelectInput(
         X.display,
         win,
-        ButtonPressMask | ExposureMask | StructureNotifyMask);
+        ButtonPressMask | ExposureMask);
 
     /* get our place on desktop */
     XChangeProperty(
@@ -677,7 +1155,7 @@ create_panel_window(uint placement, int alignment, int h, int w, int hover)
 static int
 get_active_desktop()
 {
-    return get_prop_int(X.root, X.atoms[XATOM_NET_CURRENT_DESKTOP]);
+    return get_prop_int(X.root, XATOM_NET_CURRENT_DESKTOP);
 }
 
 static void
@@ -685,6 +1163,7 @@ set_active_desktop(int d)
 {
     int i = 0;
     struct desktop *iter = P.desktops;
+    P.activedesktop = d;
     while (iter)
     {
         iter->focused = (i == d);
@@ -696,7 +1175,7 @@ set_active_desktop(int d)
 static int
 get_number_of_desktops()
 {
-    return get_prop_int(X.root, X.atoms[XATOM_NET_NUMBER_OF_DESKTOPS]);
+    return get_prop_int(X.root, XATOM_NET_NUMBER_OF_DESKTOPS);
 }
 
 static void
@@ -726,21 +1205,30 @@ rebuild_desktops()
     free_desktops();
 
     struct desktop *last = P.desktops, *d = 0;
-    int desktopsnum = get_number_of_desktops();
-    int activedesktop = get_active_desktop();
+    struct prop namesp;
+    int desktopsnum, activedesktop;
     int i, len;
 
-    char *name, *names;
-    names = name = get_prop_data(
+    mirror_prefetch(X.root, XATOM_NET_NUMBER_OF_DESKTOPS, XA_CARDINAL);
+    mirror_prefetch(X.root, XATOM_NET_CURRENT_DESKTOP, XA_CARDINAL);
+    request_prop(
+        &namesp,
         X.root,
         X.atoms[XATOM_NET_DESKTOP_NAMES],
-        X.atoms[XATOM_UTF8_STRING],
-        0);
+        X.atoms[XATOM_UTF8_STRING]);
+    desktopsnum = get_number_of_desktops();
+    activedesktop = get_active_desktop();
+
+    char *name, *names, *namesend = 0;
+    names = name = alloc_prop_string(&namesp);
+    if (names)
+        namesend = names + namesp.reply->value_len;
+    free_prop(&namesp);
 
     for (i = 0; i < desktopsnum; ++i)
     {
         d = XMALLOCZ(struct desktop, 1);
-        if (names)
+        if (names && name < namesend)
             d->name = xstrdup(name);
         else
         {
@@ -760,15 +1248,16 @@ rebuild_desktops()
             last = d;
         }
 
-        if (names)
+        if (names && name < namesend)
         {
             len = strlen(name);
             name += len + 1;
         }
     }
 
+    P.activedesktop = activedesktop;
     if (names)
-        XFree(names);
+        xfree(names);
 }
 
 static void
@@ -825,408 +1314,959 @@ activate_task(struct task *t)
 }
 
 static void
-free_tasks()
+free_task(struct task *t)
 {
-    struct task *iter, *next;
-    iter = P.tasks;
-    while (iter)
+    if (t->mirror)
     {
-        next = iter->next;
-        if (iter->icon && iter->icon != P.theme->taskbar.default_icon_img)
-        {
-            imlib_context_set_image(iter->icon);
-            imlib_free_image();
-        }
-        xfree(iter->name);
-        xfree(iter);
-        iter = next;
+        free_mirror(t->mirror);
+        xfree(t->mirror);
     }
+    if (t->icon)
+        icon_cache_release(t->icon);
+    if (t->wmclass)
+        xfree(t->wmclass);
+    xfree(t->name);
+    xfree(t);
 }
 
+static int
+is_task_visible(struct task *t)
+{
+    return (t->desktop == P.activedesktop || t->desktop == -1);
+}
+
+/* the button of a task is repainted only if it's marked dirty */
 static void
-add_task(Window win, uint focused)
+set_task_focused(struct task *t, uint focused)
 {
-    if (is_window_hidden(win))
+    if (t->focused == focused)
         return;
-
-    struct task *t = XMALLOCZ(struct task, 1);
-    t->win = win;
-    t->name = alloc_window_name(win);
-    t->desktop = get_window_desktop(win);
-    t->iconified = is_window_iconified(win);
     t->focused = focused;
-    t->icon = get_window_icon(win);
+    t->dirty = 1;
+}
 
-    XSelectInput(
-        X.display,
-        win,
-        PropertyChangeMask | FocusChangeMask | StructureNotifyMask);
+/*
+ * Re-read icons of a bunch of tasks, header walks run in lockstep. Icons
+ * with the same bytes as before come back as the same cached image, those
+ * tasks are left alone. Returns the number of icons that changed.
+ */
+static int
+update_task_icons(struct task **tasks, int num)
+{
+    struct icon_fetch *f;
+    Imlib_Image icon;
+    int i, more, changed = 0;
 
-    /* put task in list */
-    struct task *iter = P.tasks;
-    if (!iter || iter->desktop > t->desktop)
+    f = XMALLOC(struct icon_fetch, num);
+    for (i = 0; i < num; ++i)
+        start_icon_fetch(&f[i], tasks[i]->win);
+    do
     {
-        t->next = P.tasks;
-        P.tasks = t;
-        return;
-    }
+        more = 0;
+        for (i = 0; i < num; ++i)
+            more |= step_icon_fetch(&f[i]);
+    } while (more);
 
-    for (;;)
+    for (i = 0; i < num; ++i)
     {
-        if (!iter->next || iter->next->desktop > t->desktop)
+        struct task *t = tasks[i];
+        icon = get_window_icon(t->win, &f[i]);
+        free_prop(&f[i].p);
+        t->iconpending = 0;
+
+        if (icon == t->icon)
         {
-            t->next = iter->next;
-            iter->next = t;
-            return;
+            if (icon)
+                icon_cache_release(icon);
+            continue;
         }
-        iter = iter->next;
+        if (t->icon)
+            icon_cache_release(t->icon);
+        t->icon = icon;
+        t->dirty = 1;
+        changed++;
     }
+    xfree(f);
+    return changed;
 }
 
+/*
+ * Icons are loaded lazily. Tasks on other desktops start with the default
+ * icon and tasks with a disk cache hit start with the cached one. Pending
+ * icons of visible tasks are loaded right away, the rest is filled in a
+ * few at a time from the timer.
+ */
+#define ICON_IDLE_BATCH 8
+
 static void
-sort_move_task(struct task *rt)
+load_pending_icons(int idle)
 {
-    struct task *prev = 0, *next, *iter, *t = P.tasks;
-    while (t)
+    struct task_bucket *vis[2] = {&P.sticky, panel_active_bucket(&P)};
+    struct task **tasks, *t;
+    int num = 0, visible = 0, rest = 0;
+    int i, j;
+
+    for (i = 0; i < P.taskscount; ++i)
     {
-        next = t->next;
-        if (t->win == rt->win)
+        t = P.tasks[i];
+        if (!t->iconpending)
+            continue;
+        if (is_task_visible(t))
+            visible++;
+        else if (idle && rest < ICON_IDLE_BATCH)
+            rest++;
+    }
+    if (!visible && !rest)
+        return;
+
+    tasks = XMALLOC(struct task *, visible + rest);
+    for (i = 0; i < 2 && vis[i]; ++i)
+    {
+        for (j = 0; j < vis[i]->count; ++j)
         {
-            if (!prev)
-                P.tasks = next;
-            else
-                prev->next = next;
-            break;
+            if (vis[i]->tasks[j]->iconpending)
+                tasks[num++] = vis[i]->tasks[j];
         }
-        prev = t;
-        t = next;
     }
+    for (i = 0; i < P.taskscount && rest; ++i)
+    {
+        t = P.tasks[i];
+        if (t->iconpending && !is_task_visible(t))
+        {
+            tasks[num++] = t;
+            rest--;
+        }
+    }
+
+    /* icons of other desktops are not on the screen */
+    if (update_task_icons(tasks, num) && visible)
+        commence_taskbar_redraw = 1;
+    xfree(tasks);
+}
 
-    iter = P.tasks;
-    if (!iter || iter->desktop > t->desktop)
+static void
+save_icon_cache()
+{
+    struct task *t;
+    int i;
+    for (i = 0; i < P.taskscount; ++i)
     {
-        t->next = P.tasks;
-        P.tasks = t;
+        t = P.tasks[i];
+        if (t->wmclass && t->icon &&
+            t->icon != P.theme->taskbar.default_icon_img)
+            icon_disk_remember(t->wmclass, t->icon);
+    }
+    icon_disk_save();
+    icon_disk_unload();
+}
+
+/*
+ * Tasks live in P.tasks, a dense array of pointers, each task knows its
+ * slot there. Buttons are drawn from the buckets: one per desktop plus one
+ * for sticky windows, every bucket keeps its tasks in the order they were
+ * put there. So layout, painting and clicks only touch visible tasks, and
+ * moving a task to another desktop is a bucket move.
+ */
+#define MAX_TASK_DESKTOPS 1024
+
+static void
+grow_task_array(struct task ***tasks, int *alloc, int need)
+{
+    struct task **old = *tasks;
+    int oldalloc = *alloc;
+
+    if (need <= oldalloc)
         return;
+    *alloc = oldalloc ? oldalloc * 2 : 16;
+    if (*alloc < need)
+        *alloc = need;
+    *tasks = XMALLOC(struct task *, *alloc);
+    if (old)
+    {
+        memcpy(*tasks, old, sizeof(struct task *) * oldalloc);
+        xfree(old);
     }
+}
 
-    for (;;)
+static struct task_bucket *
+get_task_bucket(int desktop)
+{
+    if (desktop == -1)
+        return &P.sticky;
+    if (desktop < 0 || desktop >= MAX_TASK_DESKTOPS)
+        return &P.lost;
+
+    if (desktop >= P.bucketscount)
     {
-        if (!iter->next || iter->next->desktop > t->desktop)
+        struct task_bucket *old = P.buckets;
+        P.buckets = XMALLOCZ(struct task_bucket, desktop + 1);
+        if (old)
         {
-            t->next = iter->next;
-            iter->next = t;
-            return;
+            memcpy(
+                P.buckets,
+                old,
+                sizeof(struct task_bucket) * P.bucketscount);
+            xfree(old);
         }
-        iter = iter->next;
+        P.bucketscount = desktop + 1;
     }
+    return &P.buckets[desktop];
 }
 
 static void
-del_task(Window win)
+bucket_add(struct task_bucket *b, struct task *t)
 {
-    struct task *prev = 0, *next, *iter = P.tasks;
-    while (iter)
+    grow_task_array(&b->tasks, &b->alloc, b->count + 1);
+    t->bucketslot = b->count;
+    b->tasks[b->count++] = t;
+}
+
+/*
+ * The task knows its slot, so there is nothing to search for. The tasks
+ * after it are shifted to keep the button order, their slots follow.
+ */
+static void
+bucket_remove(struct task_bucket *b, struct task *t)
+{
+    int i = t->bucketslot;
+
+    memmove(
+        &b->tasks[i],
+        &b->tasks[i + 1],
+        sizeof(struct task *) * (b->count - i - 1));
+    b->count--;
+    for (; i < b->count; ++i)
+        b->tasks[i]->bucketslot = i;
+}
+
+static void
+free_bucket(struct task_bucket *b)
+{
+    if (b->tasks)
+        xfree(b->tasks);
+    memset(b, 0, sizeof(struct task_bucket));
+}
+
+static void
+free_tasks()
+{
+    int i;
+    for (i = 0; i < P.taskscount; ++i)
+        free_task(P.tasks[i]);
+    if (P.tasks)
+        xfree(P.tasks);
+    P.tasks = 0;
+    P.taskscount = P.tasksalloc = 0;
+
+    for (i = 0; i < P.bucketscount; ++i)
+        free_bucket(&P.buckets[i]);
+    if (P.buckets)
+        xfree(P.buckets);
+    P.buckets = 0;
+    P.bucketscount = 0;
+    free_bucket(&P.sticky);
+    free_bucket(&P.lost);
+    taskidx_clear();
+}
+
+static void
+add_task(Window win, uint focused, struct task_props *tp)
+{
+    if (is_window_hidden(tp))
+        return;
+
+    struct task *t = XMALLOCZ(struct task, 1);
+    t->win = win;
+    read_task_name_all(t, tp->names);
+    t->wmclass = tp->class;
+    t->desktop = (int)get_prop_first(&tp->desktop);
+    t->iconified = is_window_iconified(tp);
+    t->focused = focused;
+    tp->class = 0;
+
+    /*
+     * icon from the disk cache is checked against the live one later, a
+     * window which icon wasn't fetched gets the default one for now
+     */
+    if (tp->diskicon)
     {
-        next = iter->next;
-        if (iter->win == win)
+        t->icon = tp->diskicon;
+        t->iconpending = 1;
+        tp->diskicon = 0;
+    }
+    else if (tp->icon.state == ICON_FETCH_DEFERRED)
+    {
+        t->icon = P.theme->taskbar.default_icon_img;
+        t->iconpending = 1;
+    }
+    else
+        t->icon = get_window_icon(win, &tp->icon);
+
+    /* focus comes with _NET_ACTIVE_WINDOW, geometry is not our business */
+    XSelectInput(X.display, win, PropertyChangeMask);
+    taskidx_add(t);
+
+    grow_task_array(&P.tasks, &P.tasksalloc, P.taskscount + 1);
+    t->index = P.taskscount;
+    P.tasks[P.taskscount++] = t;
+    bucket_add(get_task_bucket(t->desktop), t);
+}
+
+/*
+ * Adopt a bunch of windows at once: requests for all of them are sent
+ * before the first reply is read, so the whole batch costs about one round
+ * trip.
+ */
+static void
+add_tasks(Window *wins, int num, Window focuswin)
+{
+    struct task_props *tp;
+    int i;
+
+    if (!num)
+        return;
+
+    tp = XMALLOC(struct task_props, num);
+    for (i = 0; i < num; ++i)
+        request_task_props(&tp[i], wins[i]);
+
+    /*
+     * walk the icons of the windows that are visible on the current
+     * desktop, unless the disk cache has one for the window class
+     */
+    for (i = 0; i < num; ++i)
+    {
+        int desktop;
+        if (is_window_hidden(&tp[i]))
         {
-            if (iter->icon && iter->icon != P.theme->taskbar.default_icon_img)
-            {
-                imlib_context_set_image(iter->icon);
-                imlib_free_image();
-            }
-            xfree(iter->name);
-            xfree(iter);
-            if (!prev)
-                P.tasks = next;
-            else
-                prev->next = next;
-            return;
+            cancel_icon_fetch(&tp[i].icon);
+            continue;
         }
-        prev = iter;
-        iter = next;
+        tp[i].class = alloc_window_class(&tp[i].wmclass);
+        if (!THEME_USE_TASKBAR_ICON(P.theme))
+        {
+            cancel_icon_fetch(&tp[i].icon);
+            continue;
+        }
+        if (tp[i].class)
+            tp[i].diskicon = icon_disk_find(tp[i].class);
+        desktop = (int)get_prop_first(&tp[i].desktop);
+        if (tp[i].diskicon ||
+            (desktop != P.activedesktop && desktop != -1))
+            defer_icon_fetch(&tp[i].icon);
     }
+    int more;
+    do
+    {
+        more = 0;
+        for (i = 0; i < num; ++i)
+            more |= step_icon_fetch(&tp[i].icon);
+    } while (more);
+
+    for (i = 0; i < num; ++i)
+    {
+        add_task(wins[i], (wins[i] == focuswin), &tp[i]);
+        free_task_props(&tp[i]);
+    }
+    xfree(tp);
+}
+
+static void
+move_task(struct task *t, int desktop)
+{
+    bucket_remove(get_task_bucket(t->desktop), t);
+    t->desktop = desktop;
+    bucket_add(get_task_bucket(desktop), t);
+}
+
+static void
+del_task(Window win)
+{
+    struct task *t = taskidx_find(win);
+    if (!t)
+        return;
+
+    taskidx_remove(win);
+    bucket_remove(get_task_bucket(t->desktop), t);
+
+    /* the last task takes the slot */
+    P.tasks[t->index] = P.tasks[--P.taskscount];
+    P.tasks[t->index]->index = t->index;
+    free_task(t);
 }
 
 static struct task *
 find_task(Window win)
 {
-    struct task *iter = P.tasks;
-    while (iter)
+    return taskidx_find(win);
+}
+
+static void
+update_tasks_focus(Window win)
+{
+    int i;
+    for (i = 0; i < P.taskscount; ++i)
+        set_task_focused(P.tasks[i], P.tasks[i]->win == win);
+}
+
+/*
+ * Reconcile our task list with _NET_CLIENT_LIST. Both window sets are
+ * sorted and merged, so finding the windows that are gone costs O(n log n)
+ * instead of comparing every task against every client. New windows are
+ * picked in client list order through the task index, the order in which
+ * they are adopted is the order of their buttons.
+ */
+static void
+update_tasks()
+{
+    struct prop clientlist;
+    uint32_t *wins;
+    Window focuswin, *clients, *known;
+    int num, numknown, i;
+
+    mirror_prefetch(X.root, XATOM_NET_ACTIVE_WINDOW, XA_WINDOW);
+    request_prop(
+        &clientlist,
+        X.root,
+        X.atoms[XATOM_NET_CLIENT_LIST],
+        XA_WINDOW);
+    focuswin = get_prop_window(X.root, XATOM_NET_ACTIVE_WINDOW);
+    wins = get_prop_data32(&clientlist, &num);
+
+    /* if there are no client list? we are in not NETWM compliant wm? */
+    /* if (!wins) return; */
+
+    clients = XMALLOC(Window, num + 1);
+    for (i = 0; i < num; ++i)
+        clients[i] = wins[i];
+
+    numknown = P.taskscount;
+    known = XMALLOC(Window, numknown + 1);
+    for (i = 0; i < numknown; ++i)
     {
-        if (iter->win == win)
-            return iter;
-        iter = iter->next;
+        set_task_focused(P.tasks[i], focuswin == P.tasks[i]->win);
+        known[i] = P.tasks[i]->win;
     }
-    return 0;
+
+    /* windows in my list that are not in _NET_CLIENT_LIST are deleted */
+    numknown = find_gone_windows(known, numknown, clients, num);
+    for (i = 0; i < numknown; ++i)
+        del_task(known[i]);
+    xfree(known);
+    xfree(clients);
+
+    /* for each window in _NET_CLIENT_LIST that is not in my list, add it */
+    Window *newwins = XMALLOC(Window, num + 1);
+    int newnum = 0;
+    for (i = 0; i < num; ++i)
+    {
+        /* skip panel */
+        if (wins[i] == P.win)
+            continue;
+
+        if (!find_task(wins[i]))
+            newwins[newnum++] = wins[i];
+    }
+    free_prop(&clientlist);
+
+    add_tasks(newwins, newnum, focuswin);
+    xfree(newwins);
+}
+
+/**************************************************************************
+  systray functions
+**************************************************************************/
+
+/**************************************************************************
+  X message handlers
+**************************************************************************/
+
+/*
+ * PropertyNotify dispatch. Every atom we care about has a handler for the
+ * root window, for task windows or both. A handler returns non-zero if it
+ * changed anything, then the mask of its table entry says what has to be
+ * laid out and redrawn. A handler may add more bits to the return value.
+ * Notifies for other atoms and other windows are dropped when they arrive.
+ */
+enum
+{
+    PROP_CHANGED = 1 << 0,
+    PROP_RELAYOUT = 1 << 1,
+    PROP_REDRAW_SWITCHER = 1 << 2,
+    PROP_REDRAW_TASKBAR = 1 << 3,
+    PROP_REDRAW_PANEL = 1 << 4
+};
+
+struct prop_handler
+{
+    int atom;
+    int (*handler)(struct task *t, int atom);
+    int mask;
+};
+
+/* user or WM reconfigured it's desktops */
+static int
+handle_desktops_change(struct task *t, int atom)
+{
+    rebuild_desktops();
+    return PROP_CHANGED;
+}
+
+/* user or WM switched desktop */
+static int
+handle_current_desktop_change(struct task *t, int atom)
+{
+    set_active_desktop(get_active_desktop());
+    load_pending_icons(0);
+    return PROP_CHANGED;
+}
+
+/* updates in client list */
+static int
+handle_client_list_change(struct task *t, int atom)
+{
+    update_tasks();
+    return PROP_CHANGED;
+}
+
+static int
+handle_active_window_change(struct task *t, int atom)
+{
+    update_tasks_focus(get_prop_window(X.root, XATOM_NET_ACTIVE_WINDOW));
+    return PROP_CHANGED;
+}
+
+static int
+handle_rootpmap_change(struct task *t, int atom)
+{
+    X.rootpmap = get_prop_pixmap(X.root, XATOM_XROOTPMAP_ID);
+    return PROP_CHANGED;
+}
+
+/* widow changed it's desktop */
+static int
+handle_desktop_change(struct task *t, int atom)
+{
+    move_task(t, get_prop_int(t->win, XATOM_NET_WM_DESKTOP));
+    load_pending_icons(0);
+    return PROP_CHANGED;
+}
+
+/*
+ * Title rate limiting. A window may rewrite its title many times a second,
+ * a title is repainted at most once per theme's title interval. A change
+ * that comes too soon marks the task and arms the title timer for the
+ * moment the interval ends, then the latest title is read. Every event
+ * loop has a one-shot timer for that, apart from the 1 second clock.
+ */
+static int
+get_title_interval()
+{
+    return P.theme->taskbar.title_interval;
+}
+
+/*
+ * Re-reads name sources from 'first' to 'last'. If the range ends with
+ * the last source, the title is whatever is found there, otherwise it's
+ * only replaced by a source that is set. Returns non-zero if the title
+ * bytes changed.
+ */
+static int
+update_task_name(struct task *t, int first, int last)
+{
+    struct prop names[NAME_PROPS];
+    int i, changed;
+
+    memset(names, 0, sizeof(names));
+    request_name_props(names, t->win, first, last);
+    changed = read_task_name(t, names, first, last);
+    if (changed == -1 && last == NAME_PROPS - 1)
+    {
+        t->namesrc = NAME_PROPS;
+        changed = set_task_name(t, "<unknown>", 9);
+    }
+    for (i = first; i <= last; ++i)
+        free_prop(&names[i]);
+
+    t->namepending = 0;
+    t->nametime = time_ms();
+    if (changed > 0)
+        t->dirty = 1;
+    return changed > 0;
 }
 
 static void
-update_tasks_focus(Window win)
+schedule_pending_titles()
 {
-    struct task *iter = P.tasks;
-    while (iter)
+    double due, first = 0;
+    int i, interval = get_title_interval();
+
+    for (i = 0; i < P.taskscount; ++i)
+    {
+        if (!P.tasks[i]->namepending)
+            continue;
+        due = P.tasks[i]->nametime + interval;
+        if (!first || due < first)
+            first = due;
+    }
+    if (!first)
+        return;
+
+    /* ms, at least one so a late timer doesn't spin */
+    due = first - time_ms();
+    set_title_timer(due < 1 ? 1 : due);
+}
+
+static void
+update_pending_titles()
+{
+    double now = time_ms();
+    int i, interval = get_title_interval();
+    int pending = 0;
+
+    for (i = 0; i < P.taskscount; ++i)
+    {
+        struct task *t = P.tasks[i];
+        if (!t->namepending)
+            continue;
+        if (now - t->nametime >= interval)
+        {
+            if (update_task_name(t, 0, NAME_PROPS - 1) && is_task_visible(t))
+                commence_taskbar_redraw = 1;
+        }
+        else
+            pending = 1;
+    }
+    if (pending)
+        schedule_pending_titles();
+}
+
+/*
+ * One of the name sources changed. Each task remembers which source its
+ * title came from, a change of a source with lower priority than that
+ * can't change the title. A source with higher priority is read alone,
+ * if it's set now it wins. If the current source changed, it and the ones
+ * after it are read, it may have been removed.
+ */
+static int
+handle_name_change(struct task *t, int atom)
+{
+    int interval = get_title_interval();
+    int src = find_name_prop(atom);
+
+    if (src > t->namesrc)
+        return 0;
+    if (t->namepending)
+        return 0;
+    if (interval && time_ms() - t->nametime < interval)
+    {
+        t->namepending = 1;
+        schedule_pending_titles();
+        return 0;
+    }
+    if (src < t->namesrc)
+        return update_task_name(t, src, src);
+    return update_task_name(t, src, NAME_PROPS - 1);
+}
+
+static int
+handle_state_change(struct task *t, int atom)
+{
+    struct task_props tp;
+
+    memset(&tp, 0, sizeof(tp));
+    mirror_prefetch(X.root, XATOM_NET_ACTIVE_WINDOW, XA_WINDOW);
+    request_state_props(&tp, t->win);
+    if (is_window_hidden(&tp))
+    {
+        free_task_props(&tp);
+        del_task(t->win);
+        return PROP_CHANGED | PROP_RELAYOUT;
+    }
+    t->iconified = is_window_iconified(&tp);
+    set_task_focused(
+        t,
+        get_prop_window(X.root, XATOM_NET_ACTIVE_WINDOW) == t->win);
+    free_task_props(&tp);
+    return PROP_CHANGED;
+}
+
+static int
+handle_icon_change(struct task *t, int atom)
+{
+    if (!THEME_USE_TASKBAR_ICON(P.theme))
+        return 0;
+
+    /* not on the screen, leave it for the idle loader */
+    if (!is_task_visible(t))
+    {
+        t->iconpending = 1;
+        return 0;
+    }
+
+    /* same bytes give the same cached image, nothing to redraw */
+    return update_task_icons(&t, 1);
+}
+
+static const struct prop_handler root_prop_handlers[] = {
+    {XATOM_NET_NUMBER_OF_DESKTOPS,
+     handle_desktops_change,
+     PROP_RELAYOUT | PROP_REDRAW_PANEL},
+    {XATOM_NET_DESKTOP_NAMES,
+     handle_desktops_change,
+     PROP_RELAYOUT | PROP_REDRAW_PANEL},
+    {XATOM_NET_CURRENT_DESKTOP,
+     handle_current_desktop_change,
+     PROP_RELAYOUT | PROP_REDRAW_SWITCHER | PROP_REDRAW_TASKBAR},
+    {XATOM_NET_CLIENT_LIST,
+     handle_client_list_change,
+     PROP_RELAYOUT | PROP_REDRAW_TASKBAR},
+    {XATOM_NET_ACTIVE_WINDOW, handle_active_window_change, PROP_REDRAW_TASKBAR},
+    /* the new background is picked up by the next redraw */
+    {XATOM_XROOTPMAP_ID, handle_rootpmap_change, PROP_RELAYOUT}};
+
+static const struct prop_handler task_prop_handlers[] = {
+    {XATOM_NET_WM_DESKTOP,
+     handle_desktop_change,
+     PROP_RELAYOUT | PROP_REDRAW_SWITCHER | PROP_REDRAW_TASKBAR},
+    {XATOM_NET_WM_VISIBLE_ICON_NAME, handle_name_change, PROP_REDRAW_TASKBAR},
+    {XATOM_NET_WM_ICON_NAME, handle_name_change, PROP_REDRAW_TASKBAR},
+    {XATOM_WM_ICON_NAME, handle_name_change, PROP_REDRAW_TASKBAR},
+    {XATOM_NET_WM_VISIBLE_NAME, handle_name_change, PROP_REDRAW_TASKBAR},
+    {XATOM_NET_WM_NAME, handle_name_change, PROP_REDRAW_TASKBAR},
+    {XATOM_WM_NAME, handle_name_change, PROP_REDRAW_TASKBAR},
+    {XATOM_NET_WM_STATE, handle_state_change, PROP_REDRAW_TASKBAR},
+    {XATOM_WM_STATE, handle_state_change, PROP_REDRAW_TASKBAR},
+    {XATOM_NET_WM_ICON, handle_icon_change, PROP_REDRAW_TASKBAR},
+    {XATOM_WM_HINTS, handle_icon_change, PROP_REDRAW_TASKBAR}};
+
+/* handlers by atom index, filled from the tables above */
+static const struct prop_handler *root_handlers[XATOM_COUNT];
+static const struct prop_handler *task_handlers[XATOM_COUNT];
+
+/* atom indices sorted by atom value, to map an atom back to its index */
+static int atoms_sorted[XATOM_COUNT];
+
+static int
+compare_atom_indices(const void *a, const void *b)
+{
+    Atom aa = X.atoms[*(const int *)a];
+    Atom ab = X.atoms[*(const int *)b];
+    return (aa > ab) - (aa < ab);
+}
+
+static int
+find_atom_index(Atom a)
+{
+    int lo = 0, hi = XATOM_COUNT - 1;
+    while (lo <= hi)
     {
-        iter->focused = (iter->win == win);
-        iter = iter->next;
+        int mid = (lo + hi) / 2;
+        Atom cur = X.atoms[atoms_sorted[mid]];
+        if (cur == a)
+            return atoms_sorted[mid];
+        if (cur < a)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
     }
+    return -1;
 }
 
 static void
-update_tasks()
+init_prop_handlers()
 {
-    Window *wins, focuswin;
-    int num, i, j, rev;
-
-    XGetInputFocus(X.display, &focuswin, &rev);
-
-    wins =
-        get_prop_data(X.root, X.atoms[XATOM_NET_CLIENT_LIST], XA_WINDOW, &num);
+    int i;
+    for (i = 0; i < XATOM_COUNT; ++i)
+        atoms_sorted[i] = i;
+    qsort(atoms_sorted, XATOM_COUNT, sizeof(int), compare_atom_indices);
+
+    for (i = 0; i < ARRAY_LENGTH(root_prop_handlers); ++i)
+        root_handlers[root_prop_handlers[i].atom] = &root_prop_handlers[i];
+    for (i = 0; i < ARRAY_LENGTH(task_prop_handlers); ++i)
+        task_handlers[task_prop_handlers[i].atom] = &task_prop_handlers[i];
+}
 
-    /* if there are no client list? we are in not NETWM compliant wm? */
-    /* if (!wins) return; */
+static void
+handle_property_notify(Window win, int atom)
+{
+    const struct prop_handler *h;
+    struct task *t = 0;
+    int mask;
 
-    /* if one or more windows in my list are not in _NET_CLIENT_LIST, delete
-     * them */
-    struct task *next, *iter = P.tasks;
-    while (iter)
+    if (win == X.root)
+        h = root_handlers[atom];
+    else
     {
-        iter->focused = (focuswin == iter->win);
-        next = iter->next;
-        for (j = 0; j < num; ++j)
-        {
-            if (iter->win == wins[j])
-                goto nodelete;
-        }
-        del_task(iter->win);
-    nodelete:
-        iter = next;
+        /* the task may be gone since the notify was queued */
+        h = task_handlers[atom];
+        t = find_task(win);
+        if (!t)
+            return;
     }
 
-    /* for each window in _NET_CLIENT_LIST, check if it is in out list, if
-       it's not, add it */
-    for (i = 0; i < num; ++i)
-    {
-        /* skip panel */
-        if (wins[i] == P.win)
-            continue;
+    mask = h->handler(t, atom);
+    if (!mask)
+        return;
+    mask |= h->mask;
 
-        if (!find_task(wins[i]))
-            add_task(wins[i], (wins[i] == focuswin));
-    }
-    XFree(wins);
+    if (mask & PROP_RELAYOUT)
+        commence_relayout = 1;
+    if (mask & PROP_REDRAW_PANEL)
+        commence_panel_redraw = 1;
+    if (mask & PROP_REDRAW_SWITCHER)
+        commence_switcher_redraw = 1;
+    if (mask & PROP_REDRAW_TASKBAR)
+        commence_taskbar_redraw = 1;
 }
 
-/**************************************************************************
-  systray functions
-**************************************************************************/
+/*
+ * PropertyNotify coalescing. During a dispatch cycle notifies are only
+ * queued here, a (window, atom) pair that is already queued is dropped.
+ * The queue is flushed once the X queue is drained, so every property
+ * is re-fetched at most once per cycle.
+ */
 
-/**************************************************************************
-  X message handlers
-**************************************************************************/
+#define PROPQ_SIZE 256
 
-static void
-handle_property_notify(Window win, Atom a)
+static struct
 {
-    /* global changes */
-    if (win == X.root)
-    {
-        /* user or WM reconfigured it's desktops */
-        if (a == X.atoms[XATOM_NET_NUMBER_OF_DESKTOPS] ||
-            a == X.atoms[XATOM_NET_DESKTOP_NAMES])
-        {
-            rebuild_desktops();
-            render_update_panel_positions(&P);
-            commence_panel_redraw = 1;
-            return;
-        }
-
-        /* user or WM switched desktop */
-        if (a == X.atoms[XATOM_NET_CURRENT_DESKTOP])
-        {
-            set_active_desktop(get_active_desktop());
-            render_update_panel_positions(&P);
-            commence_switcher_redraw = 1;
-            commence_taskbar_redraw = 1;
-            return;
-        }
-
-        /* updates in client list */
-        if (a == X.atoms[XATOM_NET_CLIENT_LIST])
-        {
-            update_tasks();
-            render_update_panel_positions(&P);
-            commence_taskbar_redraw = 1;
-            return;
-        }
-
-        if (a == X.atoms[XATOM_NET_ACTIVE_WINDOW])
-        {
-            Window win =
-                get_prop_window(X.root, X.atoms[XATOM_NET_ACTIVE_WINDOW]);
-            update_tasks_focus(win);
-            commence_taskbar_redraw = 1;
-            return;
-        }
+    Window win;
+    int atom; /* index in X.atoms */
+} propq[PROPQ_SIZE];
+static int propq_count;
 
-        if (a == X.atoms[XATOM_XROOTPMAP_ID])
-        {
-            X.rootpmap = get_prop_pixmap(X.root, X.atoms[XATOM_XROOTPMAP_ID]);
-            render_update_panel_positions(&P);
-            return;
-        }
-    }
+static void
+flush_property_notifies()
+{
+    int i;
 
-    /* now it's time for per-window changes */
-    struct task *t = find_task(win);
-    if (!t)
+    /* root first, client list changes create or remove tasks */
+    for (i = 0; i < propq_count; ++i)
     {
-        render_present();
-        return;
+        if (propq[i].win == X.root)
+            handle_property_notify(propq[i].win, propq[i].atom);
     }
-
-    /* widow changed it's desktop */
-    if (a == X.atoms[XATOM_NET_WM_DESKTOP])
+    for (i = 0; i < propq_count; ++i)
     {
-        t->desktop = get_window_desktop(win);
-        sort_move_task(t);
-        render_update_panel_positions(&P);
-        commence_switcher_redraw = 1;
-        commence_taskbar_redraw = 1;
-        return;
+        if (propq[i].win != X.root)
+            handle_property_notify(propq[i].win, propq[i].atom);
     }
+    propq_count = 0;
+}
 
-    /* window changed it's visible name or name */
-    if (a == X.atoms[XATOM_NET_WM_NAME] ||
-        a == X.atoms[XATOM_NET_WM_VISIBLE_NAME])
-    {
-        xfree(t->name);
-        t->name = alloc_window_name(t->win);
-        commence_taskbar_redraw = 1;
-        return;
-    }
+static void
+queue_property_notify(Window win, Atom a)
+{
+    int i, atom = find_atom_index(a);
 
-    if (a == X.atoms[XATOM_NET_WM_STATE] || a == X.atoms[XATOM_WM_STATE])
+    /* fast reject, nothing we know about */
+    if (atom == -1)
+        return;
+    mirror_invalidate(win, atom);
+    if (win == X.root)
     {
-        if (is_window_hidden(t->win))
-        {
-            del_task(t->win);
+        if (!root_handlers[atom])
             return;
-        }
-        t->iconified = is_window_iconified(t->win);
-        t->focused =
-            (get_prop_window(X.root, X.atoms[XATOM_NET_ACTIVE_WINDOW]) ==
-             t->win);
-
-        commence_taskbar_redraw = 1;
-        return;
     }
+    else if (!task_handlers[atom] || !find_task(win))
+        return;
 
-    if (a == X.atoms[XATOM_NET_WM_ICON] || a == XA_WM_HINTS)
+    for (i = 0; i < propq_count; ++i)
     {
-        if (t->icon && t->icon != P.theme->taskbar.default_icon_img)
+        if (propq[i].win == win && propq[i].atom == atom)
         {
-            imlib_context_set_image(t->icon);
-            imlib_free_image();
+            stats.coalesced++;
+            return;
         }
-        t->icon = get_window_icon(t->win);
-        commence_taskbar_redraw = 1;
-        return;
     }
+
+    if (propq_count == PROPQ_SIZE)
+        flush_property_notifies();
+
+    propq[propq_count].win = win;
+    propq[propq_count].atom = atom;
+    propq_count++;
 }
 
+/*
+ * Clicks are resolved against the hit table of the last layout and the
+ * state we already track, no round trips before the action is sent.
+ */
 static void
 handle_button(int x, int y, int button)
 {
-    int adesk = get_active_desktop();
+    struct task_bucket *vis[2] = {&P.sticky, panel_active_bucket(&P)};
+    struct task *iter, *t;
+    Window win;
+    int desk, i, j;
 
     /* second button iconize all windows, we want to see our desktop */
     if (button == 3)
     {
         return;
-        struct task *iter = P.tasks;
-        while (iter)
+        for (i = 0; i < 2 && vis[i]; ++i)
         {
-            if (iter->desktop == adesk || iter->desktop == -1)
+            for (j = 0; j < vis[i]->count; ++j)
             {
+                iter = vis[i]->tasks[j];
                 iter->iconified = 1;
-                iter->focused = 0;
+                set_task_focused(iter, 0);
                 XIconifyWindow(X.display, iter->win, X.screen);
             }
-            iter = iter->next;
         }
         commence_taskbar_redraw = 1;
         return;
     }
 
-    /* check desktops */
-    int desk = 0;
-    struct desktop *diter = P.desktops;
-    while (diter)
+    switch (render_hit_test(x, &desk, &win))
     {
-        if (x > diter->posx && x < diter->posx + diter->width &&
-            !diter->focused)
-        {
-            if (desk != adesk)
-                switch_desktop(desk);
-            /* redraw will be in property notify */
+    case HIT_DESKTOP:
+        if (desk != P.activedesktop)
+            switch_desktop(desk);
+        /* redraw will be in property notify */
+        return;
+    case HIT_TASK:
+        t = find_task(win);
+        if (t)
             break;
-        }
-        diter = diter->next;
-        desk++;
+        return;
+    default:
+        return;
     }
 
-    /* check taskbar */
-    struct task *iter = P.tasks;
-    while (iter)
+    /* the clicked task takes the focus from the rest of the desktop */
+    if (vis[1])
     {
-        if ((iter->desktop == adesk || iter->desktop == -1) &&
-            x > iter->posx && x < iter->posx + iter->width)
-        {
-            if (iter->iconified)
-            {
-                iter->iconified = 0;
-                iter->focused = 1;
-                activate_task(iter);
-            }
-            else
-            {
-                if (iter->focused)
-                {
-                    iter->iconified = 1;
-                    iter->focused = 0;
-                    XIconifyWindow(X.display, iter->win, X.screen);
-                }
-                else
-                {
-                    iter->focused = 1;
-                    activate_task(iter);
-
-                    XWindowChanges wc;
-                    wc.stack_mode = Above;
-                    XConfigureWindow(X.display, iter->win, CWStackMode, &wc);
-                }
-            }
-            /* commence_taskbar_redraw = 1; */
-        }
-        else if (iter->desktop == adesk)
+        for (j = 0; j < vis[1]->count; ++j)
         {
-            iter->focused = 0;
+            if (vis[1]->tasks[j] != t)
+                set_task_focused(vis[1]->tasks[j], 0);
         }
-        iter = iter->next;
     }
-}
 
-static void
-handle_focusin(Window win)
-{
-    struct task *iter = P.tasks;
-    while (iter)
+    if (t->iconified)
     {
-        iter->focused = (iter->win == win);
-        iter = iter->next;
+        t->iconified = 0;
+        set_task_focused(t, 1);
+        activate_task(t);
     }
+    else if (t->focused)
+    {
+        t->iconified = 1;
+        set_task_focused(t, 0);
+        XIconifyWindow(X.display, t->win, X.screen);
+    }
+    else
+    {
+        set_task_focused(t, 1);
+        activate_task(t);
+
+        XWindowChanges wc;
+        wc.stack_mode = Above;
+        XConfigureWindow(X.display, t->win, CWStackMode, &wc);
+    }
+    /* commence_taskbar_redraw = 1; */
 }
 
 /**************************************************************************
@@ -1240,6 +2280,7 @@ initX()
     X.display = XOpenDisplay(0);
     if (!X.display)
         LOG_ERROR("failed to connect to X server");
+    X.xcb = XGetXCBConnection(X.display);
     XSetErrorHandler(X_error_handler);
     XSetIOErrorHandler(X_io_error_handler);
 
@@ -1262,20 +2303,27 @@ initX()
     /* get internal atoms */
     XInternAtoms(X.display, atom_names, XATOM_COUNT, False, X.atoms);
     XSelectInput(X.display, X.root, PropertyChangeMask);
+    init_name_props();
+    init_prop_handlers();
 
-    X.rootpmap = get_prop_pixmap(X.root, X.atoms[XATOM_XROOTPMAP_ID]);
+    struct prop rootpmap, workareap;
+    request_prop(&rootpmap, X.root, X.atoms[XATOM_XROOTPMAP_ID], XA_PIXMAP);
+    request_prop(&workareap, X.root, X.atoms[XATOM_NET_WORKAREA], XA_CARDINAL);
+
+    X.rootpmap = get_prop_first(&rootpmap);
 
     /* get workarea */
-    long *workarea =
-        get_prop_data(X.root, X.atoms[XATOM_NET_WORKAREA], XA_CARDINAL, 0);
-    if (workarea)
+    int num;
+    uint32_t *workarea = get_prop_data32(&workareap, &num);
+    if (workarea && num >= 4)
     {
         X.wa_x = workarea[0];
         X.wa_y = workarea[1];
         X.wa_w = workarea[2];
         X.wa_h = workarea[3];
-        XFree(workarea);
     }
+    free_prop(&rootpmap);
+    free_prop(&workareap);
 }
 
 static void
@@ -1354,13 +2402,153 @@ freeP()
     free_theme(P.theme);
     free_tasks();
     free_desktops();
+    free_mirror(&rootmirror);
     XDestroyWindow(X.display, P.win);
     XCloseDisplay(X.display);
 }
 
+static double
+time_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+#define EVENT_TOP_TASKS 5
+
+static const char *
+get_event_name(int type)
+{
+    static const char *names[] = {
+        "",
+        "",
+        "KeyPress",
+        "KeyRelease",
+        "ButtonPress",
+        "ButtonRelease",
+        "MotionNotify",
+        "EnterNotify",
+        "LeaveNotify",
+        "FocusIn",
+        "FocusOut",
+        "KeymapNotify",
+        "Expose",
+        "GraphicsExpose",
+        "NoExpose",
+        "VisibilityNotify",
+        "CreateNotify",
+        "DestroyNotify",
+        "UnmapNotify",
+        "MapNotify",
+        "MapRequest",
+        "ReparentNotify",
+        "ConfigureNotify",
+        "ConfigureRequest",
+        "GravityNotify",
+        "ResizeRequest",
+        "CirculateNotify",
+        "CirculateRequest",
+        "PropertyNotify",
+        "SelectionClear",
+        "SelectionRequest",
+        "SelectionNotify",
+        "ColormapNotify",
+        "ClientMessage",
+        "MappingNotify",
+        "GenericEvent"};
+    if (type < 0 || type >= ARRAY_LENGTH(names))
+        return "unknown";
+    return names[type];
+}
+
+static void
+dump_stats()
+{
+    LOG_INFO(
+        "events: %u, frames: %u, events per frame: %.2f (max batch: %u)",
+        stats.events,
+        stats.frames,
+        stats.frames ? (double)stats.events / stats.frames : 0.0,
+        stats.max_batch);
+    LOG_INFO("coalesced property notifies: %u", stats.coalesced);
+    LOG_INFO(
+        "event sources: root %u, panel %u, tasks %u, other %u",
+        stats.root,
+        stats.panel,
+        stats.tasks,
+        stats.other);
+
+    int i;
+    for (i = 0; i < LASTEvent; ++i)
+    {
+        if (stats.types[i])
+            LOG_INFO("  %s: %u", get_event_name(i), stats.types[i]);
+    }
+
+    /* the chattiest windows that are still around */
+    struct task *top[EVENT_TOP_TASKS] = {0};
+    int j;
+    for (i = 0; i < P.taskscount; ++i)
+    {
+        struct task *t = P.tasks[i];
+        for (j = 0; j < EVENT_TOP_TASKS; ++j)
+        {
+            if (!top[j] || t->events > top[j]->events)
+            {
+                memmove(
+                    &top[j + 1],
+                    &top[j],
+                    sizeof(struct task *) * (EVENT_TOP_TASKS - j - 1));
+                top[j] = t;
+                break;
+            }
+        }
+    }
+    for (j = 0; j < EVENT_TOP_TASKS && top[j] && top[j]->events; ++j)
+        LOG_INFO(
+            "  window 0x%lx (%s): %u events",
+            top[j]->win,
+            top[j]->name,
+            top[j]->events);
+
+    uint hits, misses, count;
+    icon_cache_stats(&hits, &misses, &count);
+    LOG_INFO(
+        "icon cache: %u hits, %u misses, %u icons",
+        hits,
+        misses,
+        count);
+    LOG_INFO(
+        "property mirror: %u hits, %u misses",
+        mirrorstats.hits,
+        mirrorstats.misses);
+
+    uint frames;
+    ulonglong pixels;
+    render_paint_stats(&frames, &pixels);
+    LOG_INFO(
+        "repainted: %llu pixels in %u frames, %.0f pixels per frame",
+        pixels,
+        frames,
+        frames ? (double)pixels / frames : 0.0);
+
+    uint textcount, textbytes;
+    render_text_stats(&hits, &misses, &textcount, &textbytes);
+    LOG_INFO(
+        "text cache: %u hits, %u misses (%.0f%% hit rate), %u runs, %u bytes",
+        hits,
+        misses,
+        hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+        textcount,
+        textbytes);
+}
+
 static void
 cleanup()
 {
+    dump_stats();
+    save_icon_cache();
     shutdown_render();
     freeP();
     /* close(timerfd); */
@@ -1372,75 +2560,165 @@ cleanup()
 **************************************************************************/
 
 static void
-xconnection_cb()
+render_commenced()
 {
-    XEvent e;
-    while (XPending(X.display))
+    /* layout changes of a whole batch are applied at once */
+    if (commence_relayout)
     {
-        XNextEvent(X.display, &e);
-        switch (e.type)
+        render_update_panel_positions(&P);
+        commence_relayout = 0;
+    }
+
+    if (commence_panel_redraw)
+    {
+        render_panel(&P);
+    }
+    else if (commence_switcher_redraw || commence_taskbar_redraw)
+    {
+        if (commence_switcher_redraw)
         {
-        case Expose:
-            commence_panel_redraw = 1;
-            break;
-        case ButtonPress:
-            handle_button(e.xbutton.x, e.xbutton.y, e.xbutton.button);
-            break;
-        case PropertyNotify:
-            handle_property_notify(e.xproperty.window, e.xproperty.atom);
-            break;
-        case FocusIn:
-            handle_focusin(e.xfocus.window);
-            render_update_panel_positions(&P);
-            commence_taskbar_redraw = 1;
-            break;
-        default:
-            break;
+            render_switcher(P.desktops);
         }
-        XSync(X.display, 0);
-
-        if (commence_panel_redraw)
+        if (commence_taskbar_redraw)
         {
-            render_panel(&P);
+            render_taskbar(&P);
         }
-        else if (commence_switcher_redraw || commence_taskbar_redraw)
+        render_present();
+    }
+    else
+        return;
+
+    stats.frames++;
+    commence_panel_redraw = 0;
+    commence_switcher_redraw = 0;
+    commence_taskbar_redraw = 0;
+}
+
+static void
+count_event(XEvent *e)
+{
+    struct task *t;
+
+    if (e->type < LASTEvent)
+        stats.types[e->type]++;
+
+    if (e->xany.window == X.root)
+        stats.root++;
+    else if (e->xany.window == P.win)
+        stats.panel++;
+    else if ((t = find_task(e->xany.window)))
+    {
+        stats.tasks++;
+        t->events++;
+    }
+    else
+        stats.other++;
+}
+
+static void
+xconnection_cb()
+{
+    XEvent e;
+    uint events;
+
+    /*
+     * Drain the whole queue first, handlers only raise commence_* flags.
+     * XPending flushes the output buffer and picks up events generated
+     * while we were handling the previous ones, so a burst of notifies
+     * results in a single render.
+     *
+     * Property handlers and rendering wait for replies, and XCB queues
+     * the events it reads meanwhile. The socket may have nothing left for
+     * select() then, so the queue is checked again before returning.
+     */
+    do
+    {
+        events = 0;
+        while (XPending(X.display))
         {
-            if (commence_switcher_redraw)
-            {
-                render_switcher(P.desktops);
-            }
-            if (commence_taskbar_redraw)
+            XNextEvent(X.display, &e);
+            events++;
+            count_event(&e);
+
+            /*
+             * Notifies that came earlier are applied before anything else
+             * is handled, a click must see the tasks they add or remove.
+             */
+            if (e.type != PropertyNotify && propq_count)
+                flush_property_notifies();
+
+            switch (e.type)
             {
-                render_taskbar(P.tasks, P.desktops);
+            case Expose:
+                if (!render_expose(
+                        e.xexpose.x,
+                        e.xexpose.y,
+                        e.xexpose.width,
+                        e.xexpose.height))
+                    commence_panel_redraw = 1;
+                break;
+            case ButtonPress:
+                /* the hit table comes from the layout */
+                if (commence_relayout)
+                    render_commenced();
+                handle_button(e.xbutton.x, e.xbutton.y, e.xbutton.button);
+                break;
+            case PropertyNotify:
+                queue_property_notify(e.xproperty.window, e.xproperty.atom);
+                break;
+            default:
+                render_handle_event(&e);
+                break;
             }
-            render_present();
         }
-        commence_panel_redraw = 0;
-        commence_switcher_redraw = 0;
-        commence_taskbar_redraw = 0;
-    }
+
+        flush_property_notifies();
+
+        stats.events += events;
+        if (events > stats.max_batch)
+            stats.max_batch = events;
+
+        render_commenced();
+        XFlush(X.display);
+    } while (XPending(X.display));
 }
 
-/**************************************************************************
-  signal handlers
-**************************************************************************/
+static void
+timer_cb()
+{
+    /* placeholder and disk cache icons are replaced off the startup path */
+    load_pending_icons(1);
+
+    /* a frame may be waiting for a completion that got lost */
+    render_present_deferred();
+
+    /* renders, and handles events queued while we waited for replies */
+    xconnection_cb();
+}
 
 static void
-sighup_handler(int xxx)
+title_cb()
 {
-    LOG_MESSAGE("sighup signal received");
-    cleanup();
-    xmemleaks();
-    exit(0);
+    /* trailing updates of rate limited titles */
+    update_pending_titles();
+    xconnection_cb();
 }
 
+/**************************************************************************
+  signal handlers
+**************************************************************************/
+
+/*
+ * Cleanup writes the icon cache and talks to the X server, neither is safe
+ * in a signal handler. The handler only notes the signal, the event loop
+ * returns at its next wakeup and main cleans up.
+ */
+static volatile sig_atomic_t quitsignal;
+
 static void
-sigint_handler(int xxx)
+quit_handler(int sig)
 {
-    LOG_MESSAGE("sigint signal received");
-    cleanup();
-    xmemleaks();
-    exit(0);
+    quitsignal = sig;
 }
 
 /**************************************************************************
@@ -1505,10 +2783,40 @@ list_themes()
 
 #if defined(WITH_EV)
 /* ---------- libev implementation ---------- */
+static struct ev_loop *evloop;
+static ev_timer titletimer;
+
 static void
 xconnection_cb_ev(EV_P_ struct ev_io *w, int revents)
 {
     xconnection_cb();
+    if (quitsignal)
+        ev_unloop(EV_A_ EVUNLOOP_ALL);
+}
+
+static void
+timer_cb_ev(EV_P_ struct ev_timer *w, int revents)
+{
+    timer_cb();
+    if (quitsignal)
+        ev_unloop(EV_A_ EVUNLOOP_ALL);
+}
+
+static void
+title_cb_ev(EV_P_ struct ev_timer *w, int revents)
+{
+    /* one-shot, update_pending_titles arms it again if needed */
+    ev_timer_stop(EV_A_ w);
+    title_cb();
+    if (quitsignal)
+        ev_unloop(EV_A_ EVUNLOOP_ALL);
+}
+
+static void
+set_title_timer(double ms)
+{
+    titletimer.repeat = ms / 1000.0;
+    ev_timer_again(evloop, &titletimer);
 }
 
 static void
@@ -1527,6 +2835,12 @@ init_and_start_loop()
 
     clock_redraw.active = clock_redraw.pending = clock_redraw.priority = 0;
     clock_redraw.at = clock_redraw.repeat = 1.0f;
+    clock_redraw.cb = timer_cb_ev;
+
+    titletimer.active = titletimer.pending = titletimer.priority = 0;
+    titletimer.at = titletimer.repeat = 0;
+    titletimer.cb = title_cb_ev;
+    evloop = el;
 
     ev_io_start(el, &xconnection);
     ev_timer_start(el, &clock_redraw);
@@ -1534,15 +2848,51 @@ init_and_start_loop()
 }
 #elif defined(WITH_EVENT)
 /* ---------- libevent implementation ---------- */
+static struct event titletimer;
+
 static void
 xconnection_cb_event(int fd, short type, void *arg)
 {
     xconnection_cb();
+    if (quitsignal)
+    {
+        event_loopbreak();
+        return;
+    }
 
     /* reschedule */
     event_add((struct event *)arg, 0);
 }
 
+static void
+timer_cb_event(int fd, short type, void *arg)
+{
+    struct timeval tv = {1, 0};
+    timer_cb();
+    if (quitsignal)
+    {
+        event_loopbreak();
+        return;
+    }
+    event_add((struct event *)arg, &tv);
+}
+
+static void
+title_cb_event(int fd, short type, void *arg)
+{
+    title_cb();
+    if (quitsignal)
+        event_loopbreak();
+}
+
+static void
+set_title_timer(double ms)
+{
+    long us = (long)(ms * 1000.0);
+    struct timeval tv = {us / 1000000, us % 1000000};
+    event_add(&titletimer, &tv);
+}
+
 static void
 init_and_start_loop()
 {
@@ -1552,7 +2902,9 @@ init_and_start_loop()
     struct timeval tv = {1, 0};
 
     event_init();
+    evtimer_set(&clock_redraw, timer_cb_event, &clock_redraw);
     event_add(&clock_redraw, &tv);
+    evtimer_set(&titletimer, title_cb_event, 0);
 
     event_set(&xconnection, xfd, EV_READ, xconnection_cb_event, &xconnection);
     event_add(&xconnection, 0);
@@ -1561,6 +2913,17 @@ init_and_start_loop()
 }
 #else
 /* ---------- glibc 2.8 + timerfd in linux kernel ---------- */
+static int timerfd;
+static int titlefd; /* one-shot, the clock keeps its 1 second phase */
+
+static void
+set_title_timer(double ms)
+{
+    long ns = (long)(ms * 1000000.0);
+    struct itimerspec tspec = {{0, 0}, {ns / 1000000000, ns % 1000000000}};
+    timerfd_settime(titlefd, 0, &tspec, 0);
+}
+
 static void
 init_and_start_loop()
 {
@@ -1576,21 +2939,32 @@ init_and_start_loop()
     if (timerfd == -1)
         LOG_ERROR("failed to create timer fd");
     fcntl(timerfd, F_SETFL, O_NONBLOCK);
+    titlefd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (titlefd == -1)
+        LOG_ERROR("failed to create title timer fd");
+    fcntl(titlefd, F_SETFL, O_NONBLOCK);
 
     maxfd = (timerfd > xfd) ? timerfd : xfd;
+    if (titlefd > maxfd)
+        maxfd = titlefd;
 
     /* 1 second interval */
     struct itimerspec tspec = {{1, 0}, {1, 0}};
     timerfd_settime(timerfd, 0, &tspec, 0);
 
-    while (1)
+    while (!quitsignal)
     {
         FD_ZERO(&events);
         FD_SET(xfd, &events);
         FD_SET(timerfd, &events);
+        FD_SET(titlefd, &events);
 
         if (select(maxfd + 1, &events, 0, 0, 0) == -1)
+        {
+            if (errno == EINTR)
+                continue;
             break;
+        }
 
         if (FD_ISSET(xfd, &events))
             xconnection_cb();
@@ -1600,6 +2974,14 @@ init_and_start_loop()
             /* dump all stuff from timer fd to nowhere */
             while (read(timerfd, &tmp, sizeof(uint64_t)) > 0)
                 /* do nothing */;
+            timer_cb();
+        }
+        if (FD_ISSET(titlefd, &events))
+        {
+            uint64_t tmp = 0;
+            while (read(titlefd, &tmp, sizeof(uint64_t)) > 0)
+                /* do nothing */;
+            title_cb();
         }
     }
 }
@@ -1653,12 +3035,19 @@ main(int argc, char **argv)
     initX();
     initP(theme);
     init_render(&X, &P);
+    if (THEME_USE_TASKBAR_ICON(P.theme))
+        icon_disk_load(P.theme->taskbar.icon_w, P.theme->taskbar.icon_h);
 
-    signal(SIGHUP, sighup_handler);
-    signal(SIGINT, sigint_handler);
+    signal(SIGHUP, quit_handler);
+    signal(SIGINT, quit_handler);
 
+    double start = time_ms();
     rebuild_desktops();
     update_tasks();
+    LOG_INFO(
+        "startup scan: %d tasks in %.1f ms",
+        P.taskscount,
+        time_ms() - start);
 
     render_update_panel_positions(&P);
     render_panel(&P);
@@ -1666,6 +3055,11 @@ main(int argc, char **argv)
     XSync(X.display, 0);
     init_and_start_loop();
 
+    if (quitsignal)
+        LOG_MESSAGE(
+            "%s signal received",
+            quitsignal == SIGHUP ? "sighup" : "sigint");
     cleanup();
+    xmemleaks();
     return 0;
 }
@@ -6,6 +6,7 @@
 #define BMPANEL_BMPANEL_H
 
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xlib.h>
 
 /* composite */
@@ -16,23 +17,47 @@
 #include "common.h"
 #include <Imlib2.h>
 
+struct prop_mirror;
+
+/* measured size of a name, valid while font is the font it was measured in */
+struct text_extents
+{
+    Imlib_Font font;
+    int width;
+    int height;
+};
+
 struct task
 {
-    struct task *next;
+    int index; /* in panel's task array */
     char *name;
+    int namelen;
+    int namealloc;
+    int namesrc; /* name source the title came from */
+    struct text_extents extents; /* of the name */
+    char *wmclass;
     Window win;
     Imlib_Image icon;
+    uint iconpending; /* placeholder or disk cache icon, load the real one */
+    struct prop_mirror *mirror; /* property values we've read */
+    uint events; /* received, for statistics */
+    double nametime; /* ms, when the title was read last time */
+    uint namepending; /* title changed, waiting for the next repaint slot */
     int posx;
     int width;
     int desktop;
+    int bucketslot; /* in the bucket of its desktop */
     uint focused;
     uint iconified;
+    uint dirty; /* button has to be repainted */
+    uint layoutgen; /* layout pass that placed the button last time */
 };
 
 struct desktop
 {
     struct desktop *next;
     char *name;
+    struct text_extents extents; /* of the name */
     int posx;
     int width;
     uint focused;
@@ -46,11 +71,26 @@ struct tray
     int y;
 };
 
+/* tasks of a desktop in button order */
+struct task_bucket
+{
+    struct task **tasks;
+    int count;
+    int alloc;
+};
+
 struct panel
 {
     Window win;
-    struct task *tasks;
+    struct task **tasks; /* all tasks, in no particular order */
+    int taskscount;
+    int tasksalloc;
+    struct task_bucket sticky;
+    struct task_bucket *buckets; /* indexed by desktop */
+    int bucketscount;
+    struct task_bucket lost; /* desktops we never show */
     struct desktop *desktops;
+    int activedesktop;
     struct theme *theme;
     struct tray *trayicons;
     Window trayselowner;
@@ -59,6 +99,18 @@ struct panel
     int y;
 };
 
+/*
+ * Visible tasks are the sticky ones followed by the ones on the active
+ * desktop.
+ */
+static inline struct task_bucket *
+panel_active_bucket(struct panel *p)
+{
+    if (p->activedesktop < 0 || p->activedesktop >= p->bucketscount)
+        return 0;
+    return &p->buckets[p->activedesktop];
+}
+
 enum
 {
     XATOM_WM_STATE,
@@ -88,12 +140,16 @@ enum
     XATOM_UTF8_STRING,
     XATOM_MOTIF_WM_HINTS,
     XATOM_XROOTPMAP_ID,
+    XATOM_WM_HINTS,
+    XATOM_WM_ICON_NAME,
+    XATOM_WM_NAME,
     XATOM_COUNT
 };
 
 struct xinfo
 {
     Display *display;
+    xcb_connection_t *xcb;
     int screen;
     int screen_width;
     int screen_height;
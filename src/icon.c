@@ -0,0 +1,468 @@
+/*
+ * Copyright (C) 2008 nsf
+ */
+
+#include "icon.h"
+#include "logger.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**************************************************************************
+  GLOBALS
+**************************************************************************/
+
+/*
+ * Scaled task icons are shared between tasks. The key is a hash of the
+ * source ARGB data and of the target size, so 40 xterms end up with one
+ * scaled image, referenced 40 times.
+ */
+struct icon_entry
+{
+    struct icon_entry *next;
+    uint64_t key;
+    Imlib_Image img;
+    uint refs;
+};
+
+static struct icon_entry *icons;
+static uint hits;
+static uint misses;
+
+/*
+ * On-disk cache, one file per icon size: a header followed by entries of
+ * WM_CLASS, icon key and pre-scaled ARGB pixels. It is mapped at startup
+ * and rewritten on exit. A class longer than DISK_CLASS_LEN is cut, its
+ * full length and hash tell it from other classes with the same prefix.
+ */
+#define DISK_MAGIC "BMPICON2"
+#define DISK_CLASS_LEN 64
+#define DISK_MAX_ENTRIES 256
+
+struct disk_header
+{
+    char magic[8];
+    uint32_t w;
+    uint32_t h;
+    uint32_t count;
+    uint32_t pad;
+};
+
+struct disk_entry
+{
+    char wmclass[DISK_CLASS_LEN];
+    uint32_t classlen;
+    uint32_t classhash;
+    uint64_t key;
+    /* followed by w * h pixels */
+};
+
+static struct
+{
+    char path[4096 + 32];
+    int w;
+    int h;
+    uchar *map;
+    size_t mapsize;
+    uint count;
+
+    /* icons to be written back on exit */
+    char *classes[DISK_MAX_ENTRIES];
+    Imlib_Image imgs[DISK_MAX_ENTRIES];
+    uint remembered;
+} disk;
+
+/**************************************************************************
+  icon cache
+**************************************************************************/
+
+uint64_t
+icon_hash(const uint32_t *argb, int w, int h, int tw, int th)
+{
+    /* FNV-1a, fed with 32 bit words */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const uint64_t prime = 0x100000001b3ULL;
+    size_t i, n = (size_t)w * h;
+
+    hash = (hash ^ (uint32_t)w) * prime;
+    hash = (hash ^ (uint32_t)h) * prime;
+    hash = (hash ^ (uint32_t)tw) * prime;
+    hash = (hash ^ (uint32_t)th) * prime;
+    for (i = 0; i < n; ++i)
+        hash = (hash ^ argb[i]) * prime;
+
+    /* zero means "no key" */
+    return hash ? hash : 1;
+}
+
+Imlib_Image
+icon_cache_find(uint64_t key)
+{
+    struct icon_entry *iter = icons;
+    while (iter)
+    {
+        if (iter->key == key)
+        {
+            iter->refs++;
+            hits++;
+            return iter->img;
+        }
+        iter = iter->next;
+    }
+    misses++;
+    return 0;
+}
+
+int
+icon_cache_key(Imlib_Image img, uint64_t *key)
+{
+    struct icon_entry *iter = icons;
+    while (iter)
+    {
+        if (iter->img == img)
+        {
+            *key = iter->key;
+            return 1;
+        }
+        iter = iter->next;
+    }
+    return 0;
+}
+
+Imlib_Image
+icon_cache_add(uint64_t key, Imlib_Image img)
+{
+    struct icon_entry *e = XMALLOCZ(struct icon_entry, 1);
+    e->key = key;
+    e->img = img;
+    e->refs = 1;
+    e->next = icons;
+    icons = e;
+    return img;
+}
+
+void
+icon_cache_release(Imlib_Image img)
+{
+    struct icon_entry *prev = 0, *iter = icons;
+    while (iter)
+    {
+        if (iter->img == img)
+        {
+            if (--iter->refs)
+                return;
+            if (prev)
+                prev->next = iter->next;
+            else
+                icons = iter->next;
+            imlib_context_set_image(iter->img);
+            imlib_free_image();
+            xfree(iter);
+            return;
+        }
+        prev = iter;
+        iter = iter->next;
+    }
+    /* not ours (default icon), nothing to do */
+}
+
+void
+icon_cache_stats(uint *h, uint *m, uint *count)
+{
+    struct icon_entry *iter = icons;
+    *h = hits;
+    *m = misses;
+    *count = 0;
+    while (iter)
+    {
+        (*count)++;
+        iter = iter->next;
+    }
+}
+
+/**************************************************************************
+  on-disk icon cache
+**************************************************************************/
+
+static size_t
+disk_entry_size()
+{
+    return sizeof(struct disk_entry) + (size_t)disk.w * disk.h * 4;
+}
+
+static struct disk_entry *
+disk_entry(uint i)
+{
+    return (struct disk_entry *)(disk.map + sizeof(struct disk_header) +
+                                 i * disk_entry_size());
+}
+
+static uint32_t
+class_hash(const char *wmclass)
+{
+    /* FNV-1a */
+    uint32_t hash = 0x811c9dc5;
+    while (*wmclass)
+        hash = (hash ^ (uchar)*wmclass++) * 0x01000193;
+    return hash;
+}
+
+static int
+is_entry_of_class(struct disk_entry *e, const char *wmclass)
+{
+    return e->classlen == strlen(wmclass) &&
+           e->classhash == class_hash(wmclass) &&
+           !strncmp(e->wmclass, wmclass, DISK_CLASS_LEN - 1);
+}
+
+static int
+make_cache_path(int w, int h)
+{
+    char dir[4096];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (xdg && *xdg)
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    else if (home)
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return 0;
+
+    mkdir(dir, 0755);
+    strncat(dir, "/bmpanel", sizeof(dir) - strlen(dir) - 1);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+        return 0;
+
+    snprintf(disk.path, sizeof(disk.path), "%s/icons-%dx%d", dir, w, h);
+    return 1;
+}
+
+void
+icon_disk_load(int w, int h)
+{
+    struct disk_header *hdr;
+    struct stat st;
+    int fd;
+
+    disk.w = w;
+    disk.h = h;
+    if (!make_cache_path(w, h))
+        return;
+
+    fd = open(disk.path, O_RDONLY);
+    if (fd == -1)
+        return;
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(struct disk_header))
+    {
+        close(fd);
+        return;
+    }
+
+    disk.map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (disk.map == MAP_FAILED)
+    {
+        disk.map = 0;
+        return;
+    }
+    disk.mapsize = st.st_size;
+
+    hdr = (struct disk_header *)disk.map;
+    if (memcmp(hdr->magic, DISK_MAGIC, 8) || hdr->w != w || hdr->h != h ||
+        hdr->count > DISK_MAX_ENTRIES ||
+        disk.mapsize != sizeof(struct disk_header) +
+                            hdr->count * disk_entry_size())
+    {
+        LOG_WARNING("ignoring invalid icon cache: %s", disk.path);
+        icon_disk_unload();
+        return;
+    }
+    disk.count = hdr->count;
+}
+
+Imlib_Image
+icon_disk_find(const char *wmclass)
+{
+    struct disk_entry *e;
+    Imlib_Image img;
+    uint64_t key;
+    uint i;
+
+    for (i = 0; i < disk.count; ++i)
+    {
+        e = disk_entry(i);
+        if (!is_entry_of_class(e, wmclass))
+            continue;
+
+        /* the key makes a later check against the live icon a cache hit */
+        memcpy(&key, &e->key, sizeof(key));
+        img = icon_cache_find(key);
+        if (img)
+            return img;
+
+        img = imlib_create_image_using_copied_data(
+            disk.w,
+            disk.h,
+            (DATA32 *)(e + 1));
+        imlib_context_set_image(img);
+        imlib_image_set_has_alpha(1);
+        return icon_cache_add(key, img);
+    }
+    return 0;
+}
+
+void
+icon_disk_remember(const char *wmclass, Imlib_Image img)
+{
+    uint i;
+
+    if (!disk.path[0] || disk.remembered == DISK_MAX_ENTRIES)
+        return;
+    for (i = 0; i < disk.remembered; ++i)
+    {
+        if (!strcmp(disk.classes[i], wmclass))
+            return;
+    }
+
+    disk.classes[disk.remembered] = xstrdup(wmclass);
+    disk.imgs[disk.remembered] = img;
+    disk.remembered++;
+}
+
+static int
+is_remembered(struct disk_entry *e)
+{
+    uint i;
+    for (i = 0; i < disk.remembered; ++i)
+    {
+        if (is_entry_of_class(e, disk.classes[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Writes the entry of wmclass, or copies the class of 'old', an entry of
+ * the mapped file that may have its class cut already.
+ */
+static int
+write_disk_entry(
+    FILE *f,
+    const char *wmclass,
+    struct disk_entry *old,
+    uint64_t key,
+    DATA32 *pixels)
+{
+    struct disk_entry e;
+
+    memset(&e, 0, sizeof(e));
+    if (old)
+    {
+        memcpy(e.wmclass, old->wmclass, DISK_CLASS_LEN);
+        e.classlen = old->classlen;
+        e.classhash = old->classhash;
+    }
+    else
+    {
+        strncpy(e.wmclass, wmclass, DISK_CLASS_LEN - 1);
+        e.classlen = strlen(wmclass);
+        e.classhash = class_hash(wmclass);
+    }
+    e.key = key;
+    return fwrite(&e, sizeof(e), 1, f) == 1 &&
+           fwrite(pixels, 4, disk.w * disk.h, f) == disk.w * disk.h;
+}
+
+void
+icon_disk_save()
+{
+    struct disk_header hdr;
+    struct disk_entry *e;
+    char tmp[sizeof(disk.path) + 8];
+    uint64_t key;
+    FILE *f;
+    uint i;
+    int ok = 1;
+
+    if (!disk.path[0] || !disk.remembered)
+        return;
+
+    /* icons seen this session first, then old ones for absent classes */
+    memcpy(hdr.magic, DISK_MAGIC, 8);
+    hdr.w = disk.w;
+    hdr.h = disk.h;
+    hdr.count = 0;
+    hdr.pad = 0;
+    for (i = 0; i < disk.remembered; ++i)
+    {
+        if (icon_cache_key(disk.imgs[i], &key))
+            hdr.count++;
+    }
+    for (i = 0; i < disk.count && hdr.count < DISK_MAX_ENTRIES; ++i)
+    {
+        if (!is_remembered(disk_entry(i)))
+            hdr.count++;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", disk.path);
+    f = fopen(tmp, "wb");
+    if (!f)
+    {
+        LOG_WARNING("failed to write icon cache: %s", tmp);
+        return;
+    }
+
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    uint written = 0;
+    for (i = 0; ok && i < disk.remembered; ++i)
+    {
+        if (!icon_cache_key(disk.imgs[i], &key))
+            continue;
+        imlib_context_set_image(disk.imgs[i]);
+        ok = write_disk_entry(
+            f,
+            disk.classes[i],
+            0,
+            key,
+            imlib_image_get_data_for_reading_only());
+        written++;
+    }
+    for (i = 0; ok && i < disk.count && written < hdr.count; ++i)
+    {
+        e = disk_entry(i);
+        if (is_remembered(e))
+            continue;
+        memcpy(&key, &e->key, sizeof(key));
+        ok = write_disk_entry(f, 0, e, key, (DATA32 *)(e + 1));
+        written++;
+    }
+
+    if (fclose(f) != 0 || !ok)
+    {
+        LOG_WARNING("failed to write icon cache: %s", tmp);
+        unlink(tmp);
+        return;
+    }
+    rename(tmp, disk.path);
+}
+
+void
+icon_disk_unload()
+{
+    uint i;
+
+    if (disk.map)
+        munmap(disk.map, disk.mapsize);
+    disk.map = 0;
+    disk.mapsize = 0;
+    disk.count = 0;
+
+    for (i = 0; i < disk.remembered; ++i)
+        xfree(disk.classes[i]);
+    disk.remembered = 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2008 nsf
+ */
+
+#ifndef BMPANEL_ICON_H
+#define BMPANEL_ICON_H
+
+#include "common.h"
+#include <Imlib2.h>
+
+uint64_t icon_hash(const uint32_t *argb, int w, int h, int tw, int th);
+Imlib_Image icon_cache_find(uint64_t key);
+Imlib_Image icon_cache_add(uint64_t key, Imlib_Image img);
+int icon_cache_key(Imlib_Image img, uint64_t *key);
+void icon_cache_release(Imlib_Image img);
+void icon_cache_stats(uint *hits, uint *misses, uint *count);
+
+void icon_disk_load(int w, int h);
+Imlib_Image icon_disk_find(const char *wmclass);
+void icon_disk_remember(const char *wmclass, Imlib_Image img);
+void icon_disk_save();
+void icon_disk_unload();
+
+#endif
@@ -6,9 +6,17 @@
 #include "logger.h"
 #include <Imlib2.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 #include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <time.h>
 
+/* composite */
+#ifdef WITH_COMPOSITE
+#include "argb.h"
+#endif
+
 /**************************************************************************
   GLOBALS
 **************************************************************************/
@@ -27,13 +35,18 @@ static Pixmap currootpmap;
 
 static Imlib_Image bbcolor;
 
+/*
+ * Server side copy of the last presented frame. Frames are drawn here and
+ * copied to the window, an Expose is answered from it without rendering.
+ */
+static Pixmap backing;
+static GC backinggc;
+static int backingvalid;
+
 /* composite */
 #ifdef WITH_COMPOSITE
-static Imlib_Image bbalpha;
 static Pixmap pixcolor;
-static Pixmap pixalpha;
 static Picture piccolor;
-static Picture picalpha;
 static Picture rootpic;
 #endif
 
@@ -42,6 +55,30 @@ static Visual *bbvis;
 static Drawable bbwin;
 static Colormap bbcm;
 
+/*
+ * MIT-SHM presentation. The composed frame is written into a shared memory
+ * XImage and handed over with XShmPutImage, nothing goes through the
+ * socket. If the segment rows have no padding, bbcolor lives in it and the
+ * frame is composed right there. The segment can't be touched until the
+ * server reports ShmCompletion, a frame that comes earlier waits for it
+ * with its damage kept. A completion that doesn't come in SHM_TIMEOUT
+ * is given up on.
+ */
+#define SHM_TIMEOUT 500 /* ms */
+
+static struct
+{
+    XShmSegmentInfo info;
+    XImage *img;
+    int completion; /* ShmCompletion event type */
+    int direct; /* bbcolor's data is the segment */
+    int busy;
+    double sent; /* ms, when the busy frame was sent */
+    int deferred;
+} shm;
+
+static int shm_error;
+
 static struct theme *theme;
 
 /* temp vars for fast redraws */
@@ -50,10 +87,117 @@ static int switcher_width = 0;
 static int taskbar_pos = 0;
 static int taskbar_width = 0;
 
+/*
+ * Clickable regions in left to right order, rebuilt by every layout pass.
+ * Tasks are referred by window, a task may be gone before the next layout.
+ */
+struct hit
+{
+    int x;
+    int width;
+    int type;
+    int desktop;
+    Window win;
+};
+
+static struct hit *hits;
+static int hitscount;
+static int hitsalloc;
+
+/*
+ * Damage, columns of the backbuffer repainted since the last present. If
+ * there are too many of them, the whole backbuffer is damaged.
+ */
+#define MAX_DAMAGE 32
+
+static struct
+{
+    int x;
+    int width;
+} damage[MAX_DAMAGE];
+static int damagecount;
+static int damageall;
+
+/* taskbar buttons moved, the next taskbar paint can't be partial */
+static int taskbar_relayout = 1;
+static int taskbar_count;
+static uint layoutgen = 1;
+
+static struct
+{
+    uint frames;
+    ulonglong pixels;
+} paintstats;
+
+/*
+ * Composed button backgrounds. A button is its left, tile and right images
+ * at some width, these four are the key. There are a few widths and states
+ * at most, so a small table is searched linearly and the least recently
+ * used sprite gives way.
+ */
+#define MAX_SPRITES 64
+
+struct sprite
+{
+    Imlib_Image left;
+    Imlib_Image tile;
+    Imlib_Image right;
+    int width;
+    Imlib_Image img;
+    uint used;
+};
+
+static struct sprite sprites[MAX_SPRITES];
+static int spritescount;
+static uint spriteclock;
+
+/*
+ * Rasterized labels. A run is the text drawn in white, its alpha is the
+ * glyph coverage. It's tinted with the button color when blitted, so idle
+ * and pressed labels share it, and clipped by the cliprect of the caller.
+ * Like sprites, runs live in a small table that is searched by hash, the
+ * least recently used run gives way when the table is full or the cache
+ * would grow over TEXT_CACHE_BYTES.
+ */
+#define MAX_TEXT_RUNS 256
+#define TEXT_CACHE_BYTES (1024 * 1024)
+
+struct text_run
+{
+    Imlib_Font font;
+    uint32_t hash;
+    char *text;
+    int width;
+    int height;
+    Imlib_Image mask;
+    uint used;
+};
+
+static struct text_run textruns[MAX_TEXT_RUNS];
+static int textrunscount;
+static uint textclock;
+static uint textbytes;
+static Imlib_Color_Modifier tint;
+static struct color tintcolor;
+
+static struct
+{
+    uint hits;
+    uint misses;
+} textstats;
+
 /**************************************************************************
   misc helpers
 **************************************************************************/
 
+static double
+time_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
 static int
 get_image_width(Imlib_Image img)
 {
@@ -64,12 +208,12 @@ get_image_width(Imlib_Image img)
 }
 
 static void
-draw_image(Imlib_Image img, int ox)
+draw_image_onto(Imlib_Image dst, Imlib_Image img, int ox)
 {
     if (!img)
         return;
     int curw = get_image_width(img);
-    imlib_context_set_image(bb);
+    imlib_context_set_image(dst);
     imlib_blend_image_onto_image(
         img,
         1,
@@ -84,32 +228,154 @@ draw_image(Imlib_Image img, int ox)
 }
 
 static void
-tile_image(Imlib_Image img, int ox, int width)
+draw_image(Imlib_Image img, int ox)
+{
+    draw_image_onto(bb, img, ox);
+}
+
+/*
+ * Tiles img over [ox, ox + width), tiles are aligned to origin. Repainting
+ * a part of a tiled area this way gives the same pixels as tiling all of
+ * it.
+ */
+static void
+tile_image_onto(
+    Imlib_Image dst, Imlib_Image img, int origin, int ox, int width)
 {
     int curw = get_image_width(img);
-    imlib_context_set_image(bb);
+    int sx, w;
+    if (!curw)
+        return;
 
+    sx = (ox - origin) % curw;
+    imlib_context_set_image(dst);
     while (width > 0)
     {
-        width -= curw;
-        if (width < 0)
-            curw += width;
+        w = curw - sx;
+        if (w > width)
+            w = width;
 
         imlib_blend_image_onto_image(
             img,
             1,
+            sx,
             0,
-            0,
-            curw,
+            w,
             theme->height,
             ox,
             0,
-            curw,
+            w,
             theme->height);
-        ox += curw;
+        ox += w;
+        width -= w;
+        sx = 0;
     }
 }
 
+static void
+tile_image_part(Imlib_Image img, int origin, int ox, int width)
+{
+    tile_image_onto(bb, img, origin, ox, width);
+}
+
+static void
+tile_image(Imlib_Image img, int ox, int width)
+{
+    tile_image_part(img, ox, ox, width);
+}
+
+static void
+add_damage(int x, int width)
+{
+    if (damageall)
+        return;
+    if (damagecount == MAX_DAMAGE)
+    {
+        damageall = 1;
+        return;
+    }
+    damage[damagecount].x = x;
+    damage[damagecount].width = width;
+    damagecount++;
+}
+
+static void
+free_sprites()
+{
+    int i;
+    for (i = 0; i < spritescount; ++i)
+    {
+        imlib_context_set_image(sprites[i].img);
+        imlib_free_image();
+    }
+    spritescount = 0;
+}
+
+/*
+ * A sprite is blitted over the backbuffer instead of the images it's made
+ * of, so it must cover its whole area exactly like they do.
+ */
+static int
+is_sprite_opaque(Imlib_Image img)
+{
+    if (!img)
+        return 1;
+    imlib_context_set_image(img);
+    return imlib_image_get_height() >= theme->height;
+}
+
+static Imlib_Image
+get_sprite(Imlib_Image left, Imlib_Image tile, Imlib_Image right, int width)
+{
+    struct sprite *s = 0;
+    int lw, rw, i;
+
+    for (i = 0; i < spritescount; ++i)
+    {
+        s = &sprites[i];
+        if (s->width == width && s->tile == tile && s->left == left &&
+            s->right == right)
+        {
+            s->used = ++spriteclock;
+            return s->img;
+        }
+    }
+
+    if (!get_image_width(tile) || !is_sprite_opaque(left) ||
+        !is_sprite_opaque(tile) || !is_sprite_opaque(right))
+        return 0;
+
+    if (spritescount < MAX_SPRITES)
+        s = &sprites[spritescount++];
+    else
+    {
+        s = &sprites[0];
+        for (i = 1; i < MAX_SPRITES; ++i)
+        {
+            if (sprites[i].used < s->used)
+                s = &sprites[i];
+        }
+        imlib_context_set_image(s->img);
+        imlib_free_image();
+    }
+
+    s->left = left;
+    s->tile = tile;
+    s->right = right;
+    s->width = width;
+    s->used = ++spriteclock;
+    s->img = imlib_create_image(width, theme->height);
+    imlib_context_set_image(s->img);
+    imlib_image_set_has_alpha(1);
+
+    lw = get_image_width(left);
+    rw = get_image_width(right);
+    draw_image_onto(s->img, left, 0);
+    tile_image_onto(s->img, tile, lw, lw, width - lw - rw);
+    draw_image_onto(s->img, right, width - rw);
+    return s->img;
+}
+
 static void
 draw_tile_sequence(
     Imlib_Image left, Imlib_Image tile, Imlib_Image right, int ox, int width)
@@ -117,9 +383,17 @@ draw_tile_sequence(
     int lw = get_image_width(left);
     int rw = get_image_width(right);
     int tilew = width - lw - rw;
+    Imlib_Image sprite;
     if (tilew < 0)
         return;
 
+    sprite = get_sprite(left, tile, right, width);
+    if (sprite)
+    {
+        draw_image(sprite, ox);
+        return;
+    }
+
     draw_image(left, ox);
     ox += lw;
     tile_image(tile, ox, tilew);
@@ -201,6 +475,181 @@ get_text_dimensions(Imlib_Font font, const char *text, int *w, int *h)
     imlib_get_text_size(text, w, h);
 }
 
+/*
+ * Same as get_text_dimensions(), but measures text only if the cached
+ * extents are of a different font. Names reset them when they change.
+ */
+static void
+get_text_extents(
+    Imlib_Font font, const char *text, struct text_extents *e, int *w, int *h)
+{
+    if (!font || e->font != font)
+    {
+        get_text_dimensions(font, text, &e->width, &e->height);
+        e->font = font;
+    }
+    if (w)
+        *w = e->width;
+    if (h)
+        *h = e->height;
+}
+
+static uint32_t
+text_hash(const char *text)
+{
+    /* FNV-1a */
+    uint32_t hash = 0x811c9dc5;
+    while (*text)
+        hash = (hash ^ (uchar)*text++) * 0x01000193;
+    return hash;
+}
+
+static void
+free_text_run(struct text_run *r)
+{
+    imlib_context_set_image(r->mask);
+    imlib_free_image();
+    textbytes -= r->width * r->height * 4;
+    xfree(r->text);
+}
+
+static void
+free_text_runs()
+{
+    int i;
+    for (i = 0; i < textrunscount; ++i)
+        free_text_run(&textruns[i]);
+    textrunscount = 0;
+    if (tint)
+    {
+        imlib_context_set_color_modifier(tint);
+        imlib_free_color_modifier();
+        imlib_context_set_color_modifier(0);
+        tint = 0;
+    }
+}
+
+/* the last run takes the slot of the least recently used one */
+static void
+evict_text_run()
+{
+    struct text_run *r = &textruns[0];
+    int i;
+
+    for (i = 1; i < textrunscount; ++i)
+    {
+        if (textruns[i].used < r->used)
+            r = &textruns[i];
+    }
+    free_text_run(r);
+    *r = textruns[--textrunscount];
+}
+
+/* 'w' and 'h' are the text extents, the text is not measured again */
+static void
+rasterize_text_run(
+    struct text_run *r,
+    Imlib_Font font,
+    const char *text,
+    uint32_t hash,
+    int w,
+    int h)
+{
+    int cx, cy, cw, ch;
+    DATA32 *data;
+
+    r->font = font;
+    r->hash = hash;
+    r->text = xstrdup(text);
+    r->width = w;
+    r->height = h;
+    r->used = ++textclock;
+    r->mask = imlib_create_image(w, h);
+    imlib_context_set_image(r->mask);
+    imlib_image_set_has_alpha(1);
+    data = imlib_image_get_data();
+    memset(data, 0, w * h * 4);
+    imlib_image_put_back_data(data);
+
+    /* the caller's cliprect is in backbuffer coordinates */
+    imlib_context_get_cliprect(&cx, &cy, &cw, &ch);
+    imlib_context_set_cliprect(0, 0, 0, 0);
+    imlib_context_set_font(font);
+    imlib_context_set_color(255, 255, 255, 255);
+    imlib_text_draw(0, 0, text);
+    imlib_context_set_cliprect(cx, cy, cw, ch);
+
+    textbytes += w * h * 4;
+}
+
+static struct text_run *
+get_text_run(Imlib_Font font, const char *text, int w, int h)
+{
+    struct text_run *r;
+    uint32_t hash = text_hash(text);
+    uint bytes = w * h * 4;
+    int i;
+
+    for (i = 0; i < textrunscount; ++i)
+    {
+        r = &textruns[i];
+        if (r->hash == hash && r->font == font && !strcmp(r->text, text))
+        {
+            textstats.hits++;
+            r->used = ++textclock;
+            return r;
+        }
+    }
+
+    textstats.misses++;
+    if (w <= 0 || h <= 0 || bytes > TEXT_CACHE_BYTES / 4)
+        return 0;
+
+    /* make room first, so the new run is not moved by the eviction */
+    while (textrunscount &&
+           (textrunscount == MAX_TEXT_RUNS ||
+            textbytes + bytes > TEXT_CACHE_BYTES))
+        evict_text_run();
+
+    r = &textruns[textrunscount++];
+    rasterize_text_run(r, font, text, hash, w, h);
+    return r;
+}
+
+static void
+set_tint(struct color *c)
+{
+    DATA8 r[256], g[256], b[256], a[256];
+    int i;
+
+    if (tint && c->r == tintcolor.r && c->g == tintcolor.g &&
+        c->b == tintcolor.b)
+        return;
+    if (!tint)
+        tint = imlib_create_color_modifier();
+
+    for (i = 0; i < 256; ++i)
+    {
+        r[i] = c->r;
+        g[i] = c->g;
+        b[i] = c->b;
+        a[i] = i;
+    }
+    imlib_context_set_color_modifier(tint);
+    imlib_set_color_modifier_tables(r, g, b, a);
+    imlib_context_set_color_modifier(0);
+    tintcolor = *c;
+}
+
+void
+render_text_stats(uint *hits, uint *misses, uint *count, uint *bytes)
+{
+    *hits = textstats.hits;
+    *misses = textstats.misses;
+    *count = textrunscount;
+    *bytes = textbytes;
+}
+
 static void
 draw_text(
     Imlib_Font font,
@@ -210,16 +659,19 @@ draw_text(
     int offx,
     int offy,
     const char *text,
+    struct text_extents *ext,
     struct color *c)
 {
+    struct text_run *run;
     if (!font)
         return;
 
+    int texth, textw, oy;
+    get_text_extents(font, text, ext, &textw, &texth);
+    run = get_text_run(font, text, textw, texth);
     imlib_context_set_image(bb);
     imlib_context_set_font(font);
     imlib_context_set_color(c->r, c->g, c->b, 255);
-    int texth, textw, oy;
-    imlib_get_text_size(text, &textw, &texth);
     oy = (theme->height - texth) / 2;
     switch (align)
     {
@@ -236,7 +688,28 @@ draw_text(
     ox += offx;
     oy += offy;
 
-    imlib_text_draw(ox, oy, text);
+    if (!run)
+    {
+        imlib_text_draw(ox, oy, text);
+        return;
+    }
+
+    set_tint(c);
+    imlib_context_set_color_modifier(tint);
+    imlib_context_set_blend(1);
+    imlib_blend_image_onto_image(
+        run->mask,
+        1,
+        0,
+        0,
+        textw,
+        texth,
+        ox,
+        oy,
+        textw,
+        texth);
+    imlib_context_set_blend(0);
+    imlib_context_set_color_modifier(0);
 }
 
 /**************************************************************************
@@ -268,7 +741,12 @@ update_switcher_positions(int ox, struct desktop *desktops)
     ox += w;
     lastw = w;
     w += get_image_width(theme->switcher.left_corner_img[state]);
-    get_text_dimensions(theme->switcher.font, iter->name, &textw, 0);
+    get_text_extents(
+        theme->switcher.font,
+        iter->name,
+        &iter->extents,
+        &textw,
+        0);
     w += textw + theme->switcher.text_padding;
 
     while (iter->next)
@@ -276,7 +754,12 @@ update_switcher_positions(int ox, struct desktop *desktops)
         prev = iter;
         iter = iter->next;
         state = iter->focused ? BSTATE_PRESSED : BSTATE_IDLE;
-        get_text_dimensions(theme->switcher.font, iter->name, &textw, 0);
+        get_text_extents(
+            theme->switcher.font,
+            iter->name,
+            &iter->extents,
+            &textw,
+            0);
         w += get_image_width(theme->switcher.right_img[state]);
         prev->posx = ox;
         prev->width = w - lastw;
@@ -305,6 +788,7 @@ void
 render_switcher(struct desktop *desktops)
 {
     tile_image(theme->tile_img, switcher_pos, switcher_width);
+    add_damage(switcher_pos, switcher_width);
     if (!desktops)
         return;
     int ox = switcher_pos;
@@ -328,6 +812,7 @@ render_switcher(struct desktop *desktops)
         theme->switcher.text_offset_x,
         theme->switcher.text_offset_y,
         iter->name,
+        &iter->extents,
         &theme->switcher.text_color[state]);
     ox += iter->width - limgw;
 
@@ -354,6 +839,7 @@ render_switcher(struct desktop *desktops)
             theme->switcher.text_offset_x,
             theme->switcher.text_offset_y,
             iter->name,
+            &iter->extents,
             &theme->switcher.text_color[state]);
         ox += iter->width - limgw;
         iter = iter->next;
@@ -376,6 +862,7 @@ render_switcher(struct desktop *desktops)
         theme->switcher.text_offset_x,
         theme->switcher.text_offset_y,
         iter->name,
+        &iter->extents,
         &theme->switcher.text_color[state]);
 }
 
@@ -383,31 +870,47 @@ render_switcher(struct desktop *desktops)
   taskbar functions
 **************************************************************************/
 
+/*
+ * Visible tasks are the sticky bucket followed by the bucket of the active
+ * desktop, returns the number of buckets to look at.
+ */
 static int
-update_taskbar_positions(
-    int ox, int width, struct task *tasks, struct desktop *desktops)
+get_visible_buckets(struct panel *p, struct task_bucket **vis)
 {
+    int num = 0;
+    if (p->sticky.count)
+        vis[num++] = &p->sticky;
+    vis[num] = panel_active_bucket(p);
+    if (vis[num] && vis[num]->count)
+        num++;
+    return num;
+}
+
+static int
+update_taskbar_positions(int ox, int width, struct panel *p)
+{
+    struct task_bucket *vis[2];
+    struct task *t;
+    int nvis, i, j;
+
+    if (taskbar_pos != ox || taskbar_width != width)
+        taskbar_relayout = 1;
     taskbar_pos = ox;
     taskbar_width = width;
 
-    int activedesktop = 0;
-    struct desktop *iter = desktops;
-    while (iter)
-    {
-        if (iter->focused)
-            break;
-        activedesktop++;
-        iter = iter->next;
-    }
-
     int taskscount = 0;
-    struct task *t = tasks;
-    while (t)
-    {
-        if (t->desktop == activedesktop || t->desktop == -1)
-            taskscount++;
-        t = t->next;
-    }
+    nvis = get_visible_buckets(p, vis);
+    for (i = 0; i < nvis; ++i)
+        taskscount += vis[i]->count;
+
+    /*
+     * Layout changed if a button moved or wasn't there in the previous
+     * pass. Buttons that are gone make others move or change count.
+     */
+    if (taskscount != taskbar_count)
+        taskbar_relayout = 1;
+    taskbar_count = taskscount;
+    layoutgen++;
     if (!taskscount)
         return width;
 
@@ -416,111 +919,131 @@ update_taskbar_positions(
     if (sep)
         taskw -= sep;
 
-    t = tasks;
-    while (t)
+    int posx, w;
+    for (i = 0; i < nvis; ++i)
     {
-        if (t->desktop == -1)
+        for (j = 0; j < vis[i]->count; ++j)
         {
-            t->posx = ox;
-            t->width = taskw;
-            ox += taskw;
-            if (t->next)
-                ox += sep;
-        }
-        if (t->desktop == activedesktop)
-        {
-            t->posx = ox;
-            t->width = taskw;
-            ox += taskw;
-            if (t->next)
-                ox += sep;
+            t = vis[i]->tasks[j];
+            posx = ox;
+            w = taskw;
+            ox += taskw + sep;
             /* hack, fill empty space in the end of the task bar */
-            if (!t->next || t->next->desktop != activedesktop)
-                t->width += taskbar_pos + width - ox;
+            if (i == nvis - 1 && j == vis[i]->count - 1)
+                w += taskbar_pos + width - ox + sep;
+
+            if (t->layoutgen != layoutgen - 1 || t->posx != posx ||
+                t->width != w)
+                taskbar_relayout = 1;
+            t->posx = posx;
+            t->width = w;
+            t->layoutgen = layoutgen;
         }
-        t = t->next;
     }
 
     return width;
 }
 
-void
-render_taskbar(struct task *tasks, struct desktop *desktops)
+static void
+draw_task(struct task *t, int last)
 {
-    tile_image(theme->tile_img, taskbar_pos, taskbar_width);
-    int activedesktop = 0;
-    struct desktop *iter = desktops;
-    while (iter)
+    uint state;
+    int gap = theme->taskbar.space_gap;
+
+    state = t->focused ? BSTATE_PRESSED : BSTATE_IDLE;
+    /* draw bg */
+    draw_taskbar_button(state, t->posx, t->width);
+    int lgap = get_image_width(theme->taskbar.left_img[state]);
+    int rgap = get_image_width(theme->taskbar.right_img[state]);
+    int x = t->posx + gap + lgap;
+    int w = t->width - ((gap * 2) + lgap + rgap);
+
+    /* draw icon */
+    if (theme->taskbar.icon_h && theme->taskbar.icon_w)
     {
-        if (iter->focused)
-            break;
-        activedesktop++;
-        iter = iter->next;
+        int srcw, srch;
+        int y = (theme->height - theme->taskbar.icon_h) / 2;
+        imlib_context_set_image(t->icon);
+        srcw = imlib_image_get_width();
+        srch = imlib_image_get_height();
+        y += theme->taskbar.icon_offset_y;
+        x += theme->taskbar.icon_offset_x;
+        w -= theme->taskbar.icon_offset_x;
+        imlib_context_set_image(bb);
+        imlib_context_set_blend(1);
+        imlib_blend_image_onto_image(
+            t->icon,
+            1,
+            0,
+            0,
+            srcw,
+            srch,
+            x,
+            y,
+            theme->taskbar.icon_w,
+            theme->taskbar.icon_h);
+        imlib_context_set_blend(0);
+        x += theme->taskbar.icon_w;
+        w -= theme->taskbar.icon_w;
     }
 
-    struct task *t = tasks;
-    uint state;
-    int gap = theme->taskbar.space_gap;
+    /* draw text */
+    imlib_context_set_cliprect(x, 0, w, bbheight);
+    draw_text(
+        theme->taskbar.font,
+        theme->taskbar.text_align,
+        x,
+        w,
+        theme->taskbar.text_offset_x,
+        theme->taskbar.text_offset_y,
+        t->name,
+        &t->extents,
+        &theme->taskbar.text_color[state]);
+    imlib_context_set_cliprect(0, 0, bbwidth, bbheight);
+
+    /* draw separator between buttons */
+    if (!last)
+        draw_image(theme->taskbar.separator_img, x + w + gap + rgap);
+}
 
-    while (t)
+/*
+ * Only dirty buttons are repainted, over a retiled background, unless the
+ * layout changed since the last paint.
+ */
+void
+render_taskbar(struct panel *p)
+{
+    struct task_bucket *vis[2];
+    struct task *t;
+    int nvis, i, j, last;
+    int full = taskbar_relayout;
+    int sep = get_image_width(theme->taskbar.separator_img);
+
+    if (full)
+    {
+        tile_image(theme->tile_img, taskbar_pos, taskbar_width);
+        add_damage(taskbar_pos, taskbar_width);
+        taskbar_relayout = 0;
+    }
+
+    nvis = get_visible_buckets(p, vis);
+    for (i = 0; i < nvis; ++i)
     {
-        if (t->desktop == activedesktop || t->desktop == -1)
+        for (j = 0; j < vis[i]->count; ++j)
         {
-            state = t->focused ? BSTATE_PRESSED : BSTATE_IDLE;
-            /* draw bg */
-            draw_taskbar_button(state, t->posx, t->width);
-            int lgap = get_image_width(theme->taskbar.left_img[state]);
-            int rgap = get_image_width(theme->taskbar.right_img[state]);
-            int x = t->posx + gap + lgap;
-            int w = t->width - ((gap * 2) + lgap + rgap);
-
-            /* draw icon */
-            if (theme->taskbar.icon_h && theme->taskbar.icon_w)
+            t = vis[i]->tasks[j];
+            last = (i == nvis - 1 && j == vis[i]->count - 1);
+            if (!full && !t->dirty)
+                continue;
+            t->dirty = 0;
+            if (!full)
             {
-                int srcw, srch;
-                int y = (theme->height - theme->taskbar.icon_h) / 2;
-                imlib_context_set_image(t->icon);
-                srcw = imlib_image_get_width();
-                srch = imlib_image_get_height();
-                y += theme->taskbar.icon_offset_y;
-                x += theme->taskbar.icon_offset_x;
-                w -= theme->taskbar.icon_offset_x;
-                imlib_context_set_image(bb);
-                imlib_context_set_blend(1);
-                imlib_blend_image_onto_image(
-                    t->icon,
-                    1,
-                    0,
-                    0,
-                    srcw,
-                    srch,
-                    x,
-                    y,
-                    theme->taskbar.icon_w,
-                    theme->taskbar.icon_h);
-                imlib_context_set_blend(0);
-                x += theme->taskbar.icon_w;
-                w -= theme->taskbar.icon_w;
+                int w = t->width + (last ? 0 : sep);
+                tile_image_part(theme->tile_img, taskbar_pos, t->posx, w);
+                add_damage(t->posx, w);
             }
-
-            /* draw text */
-            imlib_context_set_cliprect(x, 0, w, bbheight);
-            draw_text(
-                theme->taskbar.font,
-                theme->taskbar.text_align,
-                x,
-                w,
-                theme->taskbar.text_offset_x,
-                theme->taskbar.text_offset_y,
-                t->name,
-                &theme->taskbar.text_color[state]);
-            imlib_context_set_cliprect(0, 0, bbwidth, bbheight);
-
-            /* draw separator if exists */
-            if (t->next && t->next->desktop == activedesktop)
-                draw_image(theme->taskbar.separator_img, x + w + gap + rgap);
+            draw_task(t, last);
         }
-        t = t->next;
     }
 }
 
@@ -562,6 +1085,8 @@ update_bg()
 {
     if (currootpmap != *rootpmap && *rootpmap != 0)
     {
+        /* everything is blended onto the background */
+        damageall = 1;
         currootpmap = *rootpmap;
         imlib_context_set_drawable(currootpmap);
         if (bg)
@@ -606,6 +1131,110 @@ set_bg()
     imlib_free_pixmap_and_mask(tile);
 }
 
+static int
+shm_error_handler(Display *dpy, XErrorEvent *error)
+{
+    shm_error = 1;
+    return 0;
+}
+
+static void
+free_shm()
+{
+    if (!shm.img)
+        return;
+
+    XShmDetach(bbdpy, &shm.info);
+    shm.img->data = 0;
+    XDestroyImage(shm.img);
+    shmdt(shm.info.shmaddr);
+    memset(&shm, 0, sizeof(shm));
+}
+
+/*
+ * The segment is used only if its pixels are laid out like imlib's, then
+ * imlib can draw into it. Otherwise, or if the server can't attach it
+ * (remote display), frames go through imlib as before.
+ */
+static void
+init_shm(int depth)
+{
+    uint32_t one = 1;
+    int lsb = *(uchar *)&one;
+    XErrorHandler old;
+
+    if (!XShmQueryExtension(bbdpy))
+        return;
+
+    shm.img = XShmCreateImage(
+        bbdpy,
+        bbvis,
+        depth,
+        ZPixmap,
+        0,
+        &shm.info,
+        bbwidth,
+        bbheight);
+    if (!shm.img)
+        return;
+    if (shm.img->bits_per_pixel != 32 || shm.img->red_mask != 0xff0000 ||
+        shm.img->green_mask != 0xff00 || shm.img->blue_mask != 0xff ||
+        shm.img->byte_order != (lsb ? LSBFirst : MSBFirst))
+    {
+        XDestroyImage(shm.img);
+        shm.img = 0;
+        return;
+    }
+
+    shm.info.shmid = shmget(
+        IPC_PRIVATE,
+        shm.img->bytes_per_line * shm.img->height,
+        IPC_CREAT | 0600);
+    if (shm.info.shmid == -1)
+    {
+        XDestroyImage(shm.img);
+        shm.img = 0;
+        return;
+    }
+    shm.info.shmaddr = shm.img->data = shmat(shm.info.shmid, 0, 0);
+    shm.info.readOnly = False;
+
+    shm_error = shm.info.shmaddr == (char *)-1;
+    if (!shm_error)
+    {
+        old = XSetErrorHandler(shm_error_handler);
+        XShmAttach(bbdpy, &shm.info);
+        XSync(bbdpy, False);
+        XSetErrorHandler(old);
+    }
+
+    /* the segment goes away with the last detach */
+    shmctl(shm.info.shmid, IPC_RMID, 0);
+    if (shm_error)
+    {
+        LOG_WARNING("MIT-SHM is not usable, falling back to XPutImage");
+        if (shm.info.shmaddr != (char *)-1)
+            shmdt(shm.info.shmaddr);
+        shm.img->data = 0;
+        XDestroyImage(shm.img);
+        memset(&shm, 0, sizeof(shm));
+        return;
+    }
+
+    shm.completion = XShmGetEventBase(bbdpy) + ShmCompletion;
+
+    if (shm.img->bytes_per_line == bbwidth * 4)
+    {
+        imlib_context_set_image(bbcolor);
+        imlib_free_image();
+        bbcolor = imlib_create_image_using_data(
+            bbwidth,
+            bbheight,
+            (DATA32 *)shm.img->data);
+        shm.direct = 1;
+    }
+}
+
 void
 init_render(struct xinfo *X, struct panel *P)
 {
@@ -622,6 +1251,10 @@ init_render(struct xinfo *X, struct panel *P)
     bbx = P->x;
     bby = P->y;
     rootpmap = &X->rootpmap;
+
+    /* sprites and text runs are made of the previous theme's images */
+    free_sprites();
+    free_text_runs();
     theme = P->theme;
 
     imlib_context_set_display(bbdpy);
@@ -631,15 +1264,14 @@ init_render(struct xinfo *X, struct panel *P)
 #ifdef WITH_COMPOSITE
     if (P->theme->use_composite)
     {
+        argb_init();
+
         XRenderPictFormat *fmt =
             XRenderFindStandardFormat(bbdpy, PictStandardARGB32);
-        bbalpha = imlib_create_image(bbwidth, bbheight);
 
         pixcolor = XCreatePixmap(bbdpy, bbwin, bbwidth, bbheight, 32);
-        pixalpha = XCreatePixmap(bbdpy, bbwin, bbwidth, bbheight, 32);
 
         piccolor = XRenderCreatePicture(bbdpy, pixcolor, fmt, 0, 0);
-        picalpha = XRenderCreatePicture(bbdpy, pixalpha, fmt, 0, 0);
 
         XRenderPictureAttributes pwin;
         pwin.subwindow_mode = IncludeInferiors;
@@ -652,13 +1284,14 @@ init_render(struct xinfo *X, struct panel *P)
     }
     else
 #endif
-        if (*rootpmap)
-    {
-        update_bg();
-    }
-    else
     {
-        set_bg();
+        if (*rootpmap)
+            update_bg();
+        else
+            set_bg();
+        backing = XCreatePixmap(bbdpy, bbwin, bbwidth, bbheight, X->depth);
+        backinggc = XCreateGC(bbdpy, backing, 0, 0);
+        init_shm(X->depth);
     }
 
     imlib_context_set_blend(0);
@@ -668,29 +1301,97 @@ init_render(struct xinfo *X, struct panel *P)
 void
 shutdown_render()
 {
+    free_sprites();
+    free_text_runs();
+
+    if (hits)
+        xfree(hits);
+    hits = 0;
+    hitscount = hitsalloc = 0;
+
     imlib_context_set_image(bb);
     imlib_free_image();
     imlib_context_set_image(bbcolor);
     imlib_free_image();
 
+    /* after bbcolor, it may be using the segment */
+    free_shm();
+
 #ifdef WITH_COMPOSITE
     if (theme->use_composite)
     {
-        imlib_context_set_image(bbalpha);
-        imlib_free_image();
-
         XRenderFreePicture(bbdpy, rootpic);
         XRenderFreePicture(bbdpy, piccolor);
-        XRenderFreePicture(bbdpy, picalpha);
         XFreePixmap(bbdpy, pixcolor);
-        XFreePixmap(bbdpy, pixalpha);
     }
     else
 #endif
+    {
         if (bg)
+        {
+            imlib_context_set_image(bg);
+            imlib_free_image();
+        }
+        XFreeGC(bbdpy, backinggc);
+        XFreePixmap(bbdpy, backing);
+        backing = 0;
+        backingvalid = 0;
+    }
+}
+
+static void
+add_hit(int type, int x, int width, int desktop, Window win)
+{
+    if (hitscount == hitsalloc)
     {
-        imlib_context_set_image(bg);
-        imlib_free_image();
+        struct hit *old = hits;
+        hitsalloc = hitsalloc ? hitsalloc * 2 : 32;
+        hits = XMALLOC(struct hit, hitsalloc);
+        if (old)
+        {
+            memcpy(hits, old, sizeof(struct hit) * hitscount);
+            xfree(old);
+        }
+    }
+    hits[hitscount].type = type;
+    hits[hitscount].x = x;
+    hits[hitscount].width = width;
+    hits[hitscount].desktop = desktop;
+    hits[hitscount].win = win;
+    hitscount++;
+}
+
+/* elements are laid out left to right, so the table comes out sorted */
+static void
+update_hit_table(struct panel *p)
+{
+    struct task_bucket *vis[2];
+    struct desktop *d;
+    struct task *t;
+    char *e;
+    int nvis, i, j;
+
+    hitscount = 0;
+    for (e = theme->elements; *e; ++e)
+    {
+        switch (*e)
+        {
+        case 's':
+            for (d = p->desktops, i = 0; d; d = d->next, ++i)
+                add_hit(HIT_DESKTOP, d->posx, d->width, i, 0);
+            break;
+        case 'b':
+            nvis = get_visible_buckets(p, vis);
+            for (i = 0; i < nvis; ++i)
+            {
+                for (j = 0; j < vis[i]->count; ++j)
+                {
+                    t = vis[i]->tasks[j];
+                    add_hit(HIT_TASK, t->posx, t->width, t->desktop, t->win);
+                }
+            }
+            break;
+        }
     }
 }
 
@@ -738,11 +1439,7 @@ render_update_panel_positions(struct panel *p)
         /* tray */
         /* taskbar */
         case 'b':
-            ox += update_taskbar_positions(
-                taskbarx,
-                taskbarw,
-                p->tasks,
-                p->desktops);
+            ox += update_taskbar_positions(taskbarx, taskbarw, p);
             break;
         }
         if (*++e && theme->separator_img)
@@ -750,6 +1447,36 @@ render_update_panel_positions(struct panel *p)
             ox += get_image_width(theme->separator_img);
         }
     }
+    update_hit_table(p);
+}
+
+int
+render_hit_test(int x, int *desktop, Window *win)
+{
+    int lo = 0, hi = hitscount;
+
+    /* find the last region that starts before x */
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (hits[mid].x < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo || x >= hits[lo - 1].x + hits[lo - 1].width)
+        return HIT_NONE;
+
+    *desktop = hits[lo - 1].desktop;
+    *win = hits[lo - 1].win;
+    return hits[lo - 1].type;
+}
+
+void
+render_paint_stats(uint *frames, ulonglong *pixels)
+{
+    *frames = paintstats.frames;
+    *pixels = paintstats.pixels;
 }
 
 void
@@ -757,6 +1484,9 @@ render_panel(struct panel *p)
 {
     int ox = 0;
     char *e = theme->elements;
+
+    damageall = 1;
+    taskbar_relayout = 1;
     while (*e)
     {
         switch (*e)
@@ -766,7 +1496,7 @@ render_panel(struct panel *p)
             ox += switcher_width;
             break;
         case 'b':
-            render_taskbar(p->tasks, p->desktops);
+            render_taskbar(p);
             ox += taskbar_width;
             break;
         }
@@ -779,55 +1509,171 @@ render_panel(struct panel *p)
     render_present();
 }
 
-void
-render_present()
+/*
+ * Sorts the damaged columns and merges the ones that overlap or touch,
+ * returns their number. Damage of the whole backbuffer is one column.
+ */
+static int
+merge_damage()
 {
-    update_bg();
-#ifdef WITH_COMPOSITE
-    if (theme->use_composite)
+    int i, j, n = 0;
+
+    if (damageall)
     {
-        /*
-         * Because XRender can't do directly SRCc * SRCa + DSTc * (1 - SRCa)
-         * blending, I must apply SRCa to my SRCc manually. To do this I'm
-         * using PictOpSrc with alpha channel in mask. So, I need to copy RGB
-         * data to one buffer (color) and Alpha to another buffer (mask), then
-         * use them in XRenderComposite.
-         *
-         * But I think in can be done on theme loading stage. Just apply SRCa
-         * to SRCc immediately. Optimization?
-         */
+        damage[0].x = 0;
+        damage[0].width = bbwidth;
+        return 1;
+    }
+
+    /* insertion sort, there are only a few of them */
+    for (i = 1; i < damagecount; ++i)
+    {
+        int x = damage[i].x, w = damage[i].width;
+        for (j = i; j > 0 && damage[j - 1].x > x; --j)
+            damage[j] = damage[j - 1];
+        damage[j].x = x;
+        damage[j].width = w;
+    }
 
-        /* copy color part to bbcolor */
+    for (i = 0; i < damagecount; ++i)
+    {
+        if (damage[i].width <= 0)
+            continue;
+        if (n && damage[i].x <= damage[n - 1].x + damage[n - 1].width)
+        {
+            int end = damage[i].x + damage[i].width;
+            if (end > damage[n - 1].x + damage[n - 1].width)
+                damage[n - 1].width = end - damage[n - 1].x;
+            continue;
+        }
+        damage[n++] = damage[i];
+    }
+    return n;
+}
+
+/* composes and uploads the columns [x, x + w) of the backbuffer */
+static void
+present_part(int x, int w)
+{
+    if (*rootpmap)
+    {
         imlib_context_set_image(bbcolor);
-        imlib_image_set_has_alpha(1);
-        imlib_context_set_color(0, 0, 0, 255);
-        imlib_image_fill_rectangle(0, 0, bbwidth, bbheight);
         imlib_blend_image_onto_image(
-            bb,
-            0,
+            bg,
             0,
+            x,
             0,
-            bbwidth,
+            w,
             bbheight,
+            x,
+            0,
+            w,
+            bbheight);
+        imlib_context_set_blend(1);
+        imlib_blend_image_onto_image(
+            bb,
             0,
+            x,
             0,
-            bbwidth,
+            w,
+            bbheight,
+            x,
+            0,
+            w,
             bbheight);
-        imlib_context_set_drawable(pixcolor);
-        imlib_render_image_on_drawable(0, 0);
+        imlib_context_set_blend(0);
+    }
+    else
+        imlib_context_set_image(bb);
 
-        /* copy alpha part to bbalpha */
-        imlib_context_set_image(bbalpha);
-        imlib_image_copy_alpha_to_image(bb, 0, 0);
+    if (shm.img)
+    {
+        /* composed into the segment already */
+        if (shm.direct && *rootpmap)
+            return;
+
+        DATA32 *src = imlib_image_get_data_for_reading_only();
+        int y;
+        for (y = 0; y < bbheight; ++y)
+        {
+            memcpy(
+                shm.img->data + y * shm.img->bytes_per_line + x * 4,
+                src + y * bbwidth + x,
+                w * 4);
+        }
+        return;
+    }
+
+    imlib_context_set_drawable(backing);
+    imlib_render_image_part_on_drawable_at_size(
+        x,
+        0,
+        w,
+        bbheight,
+        x,
+        0,
+        w,
+        bbheight);
+}
+
+/*
+ * Only the damaged columns are composed and uploaded. With composite the
+ * whole buffer goes to the server anyway, its premultiply pass is cheap.
+ */
+void
+render_present()
+{
+    int i, num;
+
+    /* the server still reads the last frame, damage stays for later */
+    if (shm.busy)
+    {
+        if (time_ms() - shm.sent < SHM_TIMEOUT)
+        {
+            shm.deferred = 1;
+            return;
+        }
+        LOG_WARNING("MIT-SHM completion is late, presenting anyway");
+        shm.busy = 0;
+    }
+    shm.deferred = 0;
+
+    update_bg();
+    num = merge_damage();
+    damagecount = 0;
+    damageall = 0;
+    if (!num)
+        return;
+
+    paintstats.frames++;
+    for (i = 0; i < num; ++i)
+        paintstats.pixels += (ulonglong)damage[i].width * bbheight;
+
+#ifdef WITH_COMPOSITE
+    if (theme->use_composite)
+    {
+        /*
+         * The window wants premultiplied ARGB. The backbuffer is
+         * premultiplied into bbcolor, alpha kept, in a single SIMD pass and
+         * copied as is with PictOpSrc. It used to be copied unpremultiplied
+         * and masked with its alpha, which took a second image and pixmap.
+         */
+        DATA32 *src, *dst;
+        imlib_context_set_image(bb);
+        src = imlib_image_get_data_for_reading_only();
+        imlib_context_set_image(bbcolor);
         imlib_image_set_has_alpha(1);
-        imlib_context_set_drawable(pixalpha);
+        dst = imlib_image_get_data();
+        argb_premultiply(dst, src, bbwidth * bbheight, 0);
+        imlib_image_put_back_data(dst);
+        imlib_context_set_drawable(pixcolor);
         imlib_render_image_on_drawable(0, 0);
 
         XRenderComposite(
             bbdpy,
             PictOpSrc,
             piccolor,
-            picalpha,
+            None,
             rootpic,
             0,
             0,
@@ -840,41 +1686,82 @@ render_present()
     }
     else
 #endif
-        if (*rootpmap)
     {
-        imlib_context_set_image(bbcolor);
-        imlib_blend_image_onto_image(
-            bg,
-            0,
-            0,
-            0,
-            bbwidth,
-            bbheight,
-            0,
-            0,
-            bbwidth,
-            bbheight);
-        imlib_context_set_blend(1);
-        imlib_blend_image_onto_image(
-            bb,
-            0,
-            0,
-            0,
-            bbwidth,
-            bbheight,
-            0,
-            0,
-            bbwidth,
-            bbheight);
-        imlib_context_set_blend(0);
+        for (i = 0; i < num; ++i)
+            present_part(damage[i].x, damage[i].width);
 
-        imlib_context_set_drawable(bbwin);
-        imlib_render_image_on_drawable(0, 0);
-    }
-    else
-    {
-        imlib_context_set_drawable(bbwin);
-        imlib_context_set_image(bb);
-        imlib_render_image_on_drawable(0, 0);
+        /* completion of the last request means all of them are done */
+        for (i = 0; shm.img && i < num; ++i)
+        {
+            XShmPutImage(
+                bbdpy,
+                backing,
+                backinggc,
+                shm.img,
+                damage[i].x,
+                0,
+                damage[i].x,
+                0,
+                damage[i].width,
+                bbheight,
+                i == num - 1);
+        }
+        shm.busy = shm.img != 0;
+        shm.sent = time_ms();
+
+        for (i = 0; i < num; ++i)
+        {
+            XCopyArea(
+                bbdpy,
+                backing,
+                bbwin,
+                backinggc,
+                damage[i].x,
+                0,
+                damage[i].width,
+                bbheight,
+                damage[i].x,
+                0);
+        }
+        backingvalid = 1;
     }
 }
+
+int
+render_expose(int x, int y, int width, int height)
+{
+    if (!backingvalid)
+        return 0;
+
+    XCopyArea(
+        bbdpy,
+        backing,
+        bbwin,
+        backinggc,
+        x,
+        y,
+        width,
+        height,
+        x,
+        y);
+    return 1;
+}
+
+int
+render_handle_event(XEvent *e)
+{
+    if (!shm.img || e->type != shm.completion)
+        return 0;
+
+    shm.busy = 0;
+    if (shm.deferred)
+        render_present();
+    return 1;
+}
+
+void
+render_present_deferred()
+{
+    if (shm.deferred)
+        render_present();
+}
@@ -14,11 +14,24 @@
 void init_render(struct xinfo *X, struct panel *P);
 void shutdown_render();
 
+enum
+{
+    HIT_NONE,
+    HIT_DESKTOP,
+    HIT_TASK
+};
+
 void render_update_panel_positions(struct panel *p);
+int render_hit_test(int x, int *desktop, Window *win);
 void render_switcher(struct desktop *d);
-void render_taskbar(struct task *t, struct desktop *d);
+void render_taskbar(struct panel *p);
 int render_clock();
 void render_panel(struct panel *p);
 void render_present();
+int render_handle_event(XEvent *e);
+void render_present_deferred();
+int render_expose(int x, int y, int width, int height);
+void render_paint_stats(uint *frames, ulonglong *pixels);
+void render_text_stats(uint *hits, uint *misses, uint *count, uint *bytes);
 
 #endif
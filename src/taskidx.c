@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2008 nsf
+ */
+
+#include "taskidx.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Window -> task index, an open addressing hash table with linear probing.
+ * Every PropertyNotify looks its window up here, so the lookup must not
+ * depend on the number of tasks. Table size is a power of two and is kept
+ * at most half full.
+ */
+#define TASK_INDEX_MIN_SIZE 64
+
+static struct
+{
+    struct task **slots;
+    uint size;
+    uint count;
+} taskidx;
+
+static uint
+hash_window(Window win)
+{
+    uint64_t x = (uint64_t)win * 0x9e3779b97f4a7c15ULL;
+    return (uint)(x >> 32);
+}
+
+static void
+taskidx_put(struct task *t)
+{
+    uint i = hash_window(t->win) & (taskidx.size - 1);
+    while (taskidx.slots[i])
+        i = (i + 1) & (taskidx.size - 1);
+    taskidx.slots[i] = t;
+}
+
+static void
+taskidx_grow()
+{
+    struct task **old = taskidx.slots;
+    uint i, oldsize = taskidx.size;
+
+    taskidx.size = oldsize ? oldsize * 2 : TASK_INDEX_MIN_SIZE;
+    taskidx.slots = XMALLOCZ(struct task *, taskidx.size);
+    for (i = 0; i < oldsize; ++i)
+    {
+        if (old[i])
+            taskidx_put(old[i]);
+    }
+    if (old)
+        xfree(old);
+}
+
+void
+taskidx_add(struct task *t)
+{
+    if ((taskidx.count + 1) * 2 > taskidx.size)
+        taskidx_grow();
+    taskidx_put(t);
+    taskidx.count++;
+}
+
+struct task *
+taskidx_find(Window win)
+{
+    uint i;
+    if (!taskidx.count)
+        return 0;
+
+    i = hash_window(win) & (taskidx.size - 1);
+    while (taskidx.slots[i])
+    {
+        if (taskidx.slots[i]->win == win)
+            return taskidx.slots[i];
+        i = (i + 1) & (taskidx.size - 1);
+    }
+    return 0;
+}
+
+void
+taskidx_remove(Window win)
+{
+    uint mask = taskidx.size - 1;
+    uint i, j, home;
+
+    if (!taskidx.count)
+        return;
+
+    i = hash_window(win) & mask;
+    while (taskidx.slots[i] && taskidx.slots[i]->win != win)
+        i = (i + 1) & mask;
+    if (!taskidx.slots[i])
+        return;
+
+    /*
+     * backward shift deletion: move up the entries of the cluster that
+     * would not be found anymore through the hole, no tombstones needed
+     */
+    j = i;
+    for (;;)
+    {
+        taskidx.slots[i] = 0;
+        do
+        {
+            j = (j + 1) & mask;
+            if (!taskidx.slots[j])
+            {
+                taskidx.count--;
+                return;
+            }
+            home = hash_window(taskidx.slots[j]->win) & mask;
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        taskidx.slots[i] = taskidx.slots[j];
+        i = j;
+    }
+}
+
+void
+taskidx_clear()
+{
+    if (taskidx.slots)
+        xfree(taskidx.slots);
+    memset(&taskidx, 0, sizeof(taskidx));
+}
+
+static int
+compare_windows(const void *a, const void *b)
+{
+    Window wa = *(const Window *)a;
+    Window wb = *(const Window *)b;
+    return (wa > wb) - (wa < wb);
+}
+
+/*
+ * Sorts both window sets and leaves in 'known' the windows that are not in
+ * 'clients', returns their number.
+ */
+int
+find_gone_windows(Window *known, int numknown, Window *clients, int num)
+{
+    int i, j, gone = 0;
+
+    qsort(clients, num, sizeof(Window), compare_windows);
+    qsort(known, numknown, sizeof(Window), compare_windows);
+    for (i = 0, j = 0; i < numknown; ++i)
+    {
+        while (j < num && clients[j] < known[i])
+            j++;
+        if (j == num || clients[j] != known[i])
+            known[gone++] = known[i];
+    }
+    return gone;
+}
@@ -0,0 +1,16 @@
+/*
+ * Copyright (C) 2008 nsf
+ */
+
+#ifndef BMPANEL_TASKIDX_H
+#define BMPANEL_TASKIDX_H
+
+#include "bmpanel.h"
+
+void taskidx_add(struct task *t);
+struct task *taskidx_find(Window win);
+void taskidx_remove(Window win);
+void taskidx_clear();
+int find_gone_windows(Window *known, int numknown, Window *clients, int num);
+
+#endif
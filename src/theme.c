@@ -34,6 +34,8 @@ load_theme(const char *dir)
 
     struct theme *t = XMALLOCZ(struct theme, 1);
     t->themedir = xstrdup(dir);
+    t->taskbar.title_max_len = DEFAULT_TITLE_MAX_LEN;
+    t->taskbar.title_interval = DEFAULT_TITLE_INTERVAL;
     if (!load_and_parse_theme(t))
     {
         free_theme(t);
@@ -355,6 +357,8 @@ parse_key_value(const char *key, const char *value, struct theme *t)
     ECMP("tb_icon_offset_y") { PARSE_INT(t->taskbar.icon_offset_y); }
     ECMP("tb_icon_w") { PARSE_INT(t->taskbar.icon_w); }
     ECMP("tb_icon_h") { PARSE_INT(t->taskbar.icon_h); }
+    ECMP("tb_title_max_len") { PARSE_INT(t->taskbar.title_max_len); }
+    ECMP("tb_title_interval") { PARSE_INT(t->taskbar.title_interval); }
     ECMP("tb_space_gap")
     {
         PARSE_INT(t->taskbar.space_gap);
@@ -21,6 +21,9 @@
 #define WIDTH_TYPE_PIXELS 0
 #define WIDTH_TYPE_PERCENT 1
 
+#define DEFAULT_TITLE_MAX_LEN 256
+#define DEFAULT_TITLE_INTERVAL 250
+
 struct color
 {
     uchar r, g, b;
@@ -65,6 +68,9 @@ struct taskbar_theme
     int icon_w;
     int icon_h;
 
+    int title_max_len;
+    int title_interval; /* ms between repaints of a title */
+
     int space_gap;
 };
 